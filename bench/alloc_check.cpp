@@ -0,0 +1,131 @@
+// Checks StarFinder's steady state doesn't allocate: once it's seen a
+// frame size, findStars on more frames that size (or on a size it's
+// still got a workspace for) mustn't touch the heap, and the workspace
+// images mustn't move. Returns nonzero if they do
+
+#include "StarFinder.h"
+#include "StarField.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+// GCC inlines these into their callers and then warns about
+// free being called on what new returned, so keep them apart
+#if defined( __GNUC__ )
+#define SH_NOINLINE __attribute__( ( noinline ) )
+#else
+#define SH_NOINLINE
+#endif
+
+// Every operator new while we're counting. cv::Mat allocates
+// through fastMalloc instead, so those show up as moved data
+static std::atomic<bool> g_bCounting( false );
+static std::atomic<size_t> g_nAllocs( 0 );
+
+SH_NOINLINE void * operator new( size_t nBytes )
+{
+	if ( g_bCounting )
+		g_nAllocs++;
+	if ( void * p = malloc( nBytes ? nBytes : 1 ) )
+		return p;
+	throw std::bad_alloc();
+}
+
+void * operator new[]( size_t nBytes )
+{
+	return operator new( nBytes );
+}
+
+SH_NOINLINE void operator delete( void * p ) noexcept
+{
+	free( p );
+}
+
+void operator delete[]( void * p ) noexcept
+{
+	operator delete( p );
+}
+
+void operator delete( void * p, size_t ) noexcept
+{
+	operator delete( p );
+}
+
+void operator delete[]( void * p, size_t ) noexcept
+{
+	operator delete( p );
+}
+
+// Gets at findStars and the workspace it used
+class StarFinder_AllocCheck : public StarFinder
+{
+public:
+	bool FindStars( const img_t& img )
+	{
+		return findStars( img );
+	}
+
+	std::vector<const void *> GetBuffers() const
+	{
+		return { m_pWorkspace, m_pWorkspace->imgInput.data, m_pWorkspace->imgBoolean.data };
+	}
+};
+
+// A full frame and a live view sized one, like switching between them
+const cv::Size kSizes[] = { cv::Size( 1600, 1200 ), cv::Size( 640, 480 ) };
+const int kWarmupFrames = 2;
+const int kFrames = 20;
+
+int main()
+{
+	std::vector<img_t> vFrames;
+	for ( const cv::Size sz : kSizes )
+	{
+		StarFieldParams params;
+		params.szFrame = sz;
+		params.nFrames = 1;
+		params.fDriftX = 1.5f;
+		img_t img;
+		StarFieldSource( params ).GetNextImage( &img );
+		vFrames.push_back( img );
+	}
+
+	int nFailed = 0;
+	for ( const bool bBorrow : { true, false } )
+	{
+		StarFinder_AllocCheck finder;
+		finder.SetBorrowInput( bBorrow );
+
+		// The first frames of each size make the workspaces
+		std::vector<std::vector<const void *>> vBuffers;
+		for ( const img_t& img : vFrames )
+		{
+			for ( int i = 0; i < kWarmupFrames; i++ )
+				finder.FindStars( img );
+			vBuffers.push_back( finder.GetBuffers() );
+		}
+
+		// After that nothing should be allocated, going back and forth or not
+		size_t nMoved = 0;
+		g_nAllocs = 0;
+		for ( int i = 0; i < kFrames; i++ )
+		{
+			const int nSize = ( i / 4 ) % 2;
+			g_bCounting = true;
+			finder.FindStars( vFrames[nSize] );
+			g_bCounting = false;
+			nMoved += finder.GetBuffers() != vBuffers[nSize];
+		}
+
+		const size_t nAllocs = g_nAllocs;
+		printf( "%-10s %zu allocations, %zu frames with moved buffers in %d frames\n",
+				bBorrow ? "borrowed" : "copied", nAllocs, nMoved, kFrames );
+		if ( nAllocs || nMoved )
+			nFailed++;
+	}
+
+	return nFailed ? 1 : 0;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CPU kernels for bayered sensor data. Our cameras are RGGB
+// (even rows RGRG..., odd rows GBGB...), which is what OpenCV
+// calls BayerBG. Inputs are 16 bit mats, which can be views
+// right into a LibRaw buffer since only the rows are walked
+
+// Does cvtColor( CV_BayerBG2GRAY ), convertTo( CV_32FC1, fScale )
+// and threshold( fThreshold, CV_THRESH_TOZERO ) in one pass over
+// the bayer data. Each gray value is the bilinear interpolation
+// cvtColor does (the outermost rows and columns copy their
+// neighbours), but kept in float rather than rounded to 16 bits
+void BayerToGray( const cv::Mat& imgBayer, const float fScale, const float fThreshold, cv::Mat& imgGray );
+
+// Bins each 2x2 RGGB quad of the bayer data into one pixel of a half
+// size float image, scaled by fScale and thresholded like BayerToGray.
+// The quad is averaged so intensities stay where BayerToGray puts them
+// (only the colour weights differ). An odd last row or column is dropped
+void BayerBin2x2( const cv::Mat& imgBayer, const float fScale, const float fThreshold, cv::Mat& imgGray );
+
+// LibRaw's raw2image gives 4 shorts per pixel, only one of them
+// nonzero (the bayer component there). This writes each pixel's
+// sum of the 4, shifted up 2 bits, to pBayer. It picks SSE2, AVX2
+// or NEON code depending on what the CPU can do
+void SumBayerChannels( const uint16_t * pChannels, const size_t nPixels, uint16_t * pBayer );
+
+// The kernels SumBayerChannels can pick from (Best is the one it does pick)
+enum class BayerKernel { Best, Scalar, SSE2, AVX2, NEON };
+
+// SumBayerChannels with the kernel forced, so bench/ can time and check
+// each one. Returns false without touching pBayer if this build or this
+// CPU can't run eKernel
+bool SumBayerChannels( const BayerKernel eKernel, const uint16_t * pChannels, const size_t nPixels, uint16_t * pBayer );
@@ -3,10 +3,14 @@
 #if SH_CAMERA
 
 #include "Engine.h"
+#include "FrameRing.h"
+#include "EvfDecoder.h"
+#include "FrameStacker.h"
 
 #include <thread>
 #include <mutex>
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
 
 #if SH_USE_EDSDK
@@ -14,7 +18,6 @@
 
 #include <mutex>
 #include <thread>
-#include <list>
 #include <memory>
 #include <atomic>
 #include <chrono>
@@ -41,16 +44,27 @@ public:
 
 private:
 	// A thread is spawned to capture images
-	// and store them in this list. The list
-	// is cleared whenever modes are switched
+	// and store them in this ring. What's in
+	// it is dropped whenever modes are switched
     std::thread m_thCapture;
-    std::mutex m_muCapture;
 
 	// These images are returned via GetNextImage
 	// if the mode is streaming - if the mode is
 	// Capturing, WAIT is always returned until
-	// the capturing is done (img limit hit)
-    std::list<img_t> m_liCapturedImages;
+	// the capturing is done (img limit hit).
+	// The capture thread is the only producer and
+	// GetNextImage's caller the only consumer; if
+	// it falls behind the oldest frames are dropped
+	FrameRing m_frCapturedImages;
+
+	// Bumped on mode switches; frames are pushed with the
+	// generation they were captured in and older ones skipped
+	std::atomic<size_t> m_nModeGeneration;
+
+	// Signalled when an image is posted or the mode
+	// changes, so WaitForNextImage can wake right away
+	std::mutex m_muCapture;
+	std::condition_variable m_cvCapture;
 
 	// Camera mode, can be accessed
 	// and modified from threads so
@@ -78,10 +92,22 @@ private:
 	// to control the camera
 	CommandQueue m_CMDQueue;
 	
-	// The streaming code takes an average
-	// of the incoming frames - the images
-	// being averaged are stored here
-	std::list<cv::Mat> m_liImageStack;
+	// The streaming code stacks the incoming frames over a
+	// sliding window. Only the decode thread touches the
+	// stacker; it picks up new settings from the atomics,
+	// and mode switches flag it to start over
+	FrameStacker m_EvfStacker;
+	std::atomic<int> m_nEvfStackFrames;
+	std::atomic<bool> m_bEvfSigmaClip;
+	std::atomic<bool> m_bResetEvfStack;
+#if SH_CUDA
+	cv::Mat m_imgEvfStacked;
+#endif
+
+	// Live view JPEGs are decoded on this one's thread, which
+	// hands them to postEvfImage. It goes after everything
+	// postEvfImage touches so it's stopped before they go
+	std::unique_ptr<EvfDecoder> m_upEvfDecoder;
 
 
 
@@ -98,13 +124,28 @@ public:
 	void SetMode( const Mode m );
 	Mode GetMode();
 
+	// Decode streamed frames at 1/nDenom size (1, 2 or 4). It's
+	// done in the JPEG decoder, and 2 is like binning 2x2: each
+	// pixel is the average of a 2x2 block, with less noise
+	void SetEvfDownscale( const int nDenom );
+
+	// Stack streamed frames over a sliding window of the last
+	// nFrames (1 doesn't stack), optionally sigma clipping out
+	// satellites and the like. There's a stacked frame per frame
+	void SetEvfStacking( const int nFrames, const bool bSigmaClip );
+
+	// Number of streamed frames dropped because
+	// GetNextImage wasn't called often enough
+	size_t GetDroppedImageCount() const;
+
 	// ImageSource overrides
 	ImageSource::Status GetNextImage( img_t * pImg ) override;
+	ImageSource::Status WaitForNextImage( img_t * pImg, const std::chrono::milliseconds tTimeout ) override;
     void Initialize() override;
     void Finalize() override;
 
 #if SH_USE_EDSDK
-	// EVF receiver override, posts to main thread
+	// EVF receiver override, hands the JPEG to the decoder
 	bool handleEvfImage() override;
 
 	// Captured image handler, downloads to disk
@@ -118,6 +159,12 @@ private:
 	// and exits when the mode transitions to off
     void threadProc();
 
+#if SH_USE_EDSDK
+	// Stacks decoded live view frames and posts them (decode thread),
+	// unless they were downloaded before the last mode switch
+	void postEvfImage( const cv::Mat& img, const size_t nGeneration );
+#endif
+
 #if SH_USE_EDSDK
     EdsError EDSCALLBACK handleObjectEvent_impl( EdsUInt32			inEvent,
                                      EdsBaseRef			inRef,
@@ -1 +1,11 @@
 #pragma once
+
+// Circle struct - made my
+// own so it can be constructed
+// in host and device code
+struct Circle
+{
+	float fX;	// x pos
+	float fY;	// y pos
+	float fR;	// radius
+};
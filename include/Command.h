@@ -6,6 +6,8 @@
 #include <list>
 #include <algorithm>
 #include <mutex>
+#include <condition_variable>
+#include <chrono>
 #include <thread>
 #include <atomic>
 
@@ -244,12 +246,14 @@ public:
 class CommandQueue
 {
 	std::mutex m_muCommandMutex;
+	std::condition_variable m_cvCommand;
 	std::list<CmdPtr> m_liCommands;
 	CmdPtr m_pCloseCommand;
 public:
 	CommandQueue();
 	~CommandQueue();
 	CmdPtr pop();
+	CmdPtr pop( const std::chrono::milliseconds tTimeout );	// Waits up to tTimeout for a command
 	void push_back( Command * pCMD );
 	void clear( bool bClose = false );
 	void waitTillCompletion();
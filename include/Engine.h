@@ -2,6 +2,7 @@
 
 #include <opencv2/opencv.hpp>
 
+#include <chrono>
 #include <memory>
 
 #include "Util.h"
@@ -15,7 +16,16 @@ public:
         DONE
     };
 
+	// A READY image stays valid and unmodified until the
+	// next call to GetNextImage; sources must not write
+	// into a frame they've handed out before then
 	virtual Status GetNextImage( img_t * pImg ) = 0;
+
+	// Like GetNextImage, but waits up to tTimeout for an image
+	// rather than returning WAIT right away. Sources that know
+	// when frames arrive should override this to wake up as
+	// soon as one does; the default just sleeps and tries again
+	virtual Status WaitForNextImage( img_t * pImg, const std::chrono::milliseconds tTimeout );
     virtual void Initialize() {}
     virtual void Finalize() {}
 
@@ -29,7 +39,10 @@ class ImageProcessor
 public:
 	virtual ~ImageProcessor() {}
 
-	virtual bool HandleImage( img_t img ) = 0;	// Take an image as input
+	// Take an image as input. The image is borrowed read-only for
+	// the duration of the call: don't write to it, and clone it if
+	// you need its data after returning (see ImageSource::GetNextImage)
+	virtual bool HandleImage( const img_t& img ) = 0;
 
     virtual void Initialize() {}
 	virtual void Finalize() {}						
@@ -39,9 +52,33 @@ public:
 
 class Engine
 {
+public:
+	// What the acquisition thread does when the processor falls behind
+	enum class Backlog
+	{
+		Block,		// Stop acquiring until there's room
+		DropOldest	// Throw away the oldest waiting frame
+	};
+
+private:
 	ImageSource::Ptr m_pImageSource;
 	ImageProcessor::Ptr m_pImageProcessor;
+
+	// Frames allowed in flight between threads (0 runs serially)
+	size_t m_nQueueDepth;
+	Backlog m_eBacklog;
+
+	void runSerial();
+	void runPipelined();
+
 public:
 	Engine( ImageSource::Ptr&& pImgSrc, ImageProcessor::Ptr&& pImgProc );
+
+	// Get images from the source on their own thread, so the next frame
+	// is being read / decoded while the processor works on this one.
+	// Up to nQueueDepth frames wait between them. The source's
+	// Initialize and Finalize still happen on the thread calling Run
+	void SetPipelined( const size_t nQueueDepth, const Backlog eBacklog = Backlog::Block );
+
 	void Run();
 };
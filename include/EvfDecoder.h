@@ -0,0 +1,65 @@
+#pragma once
+
+#include "FramePool.h"
+
+#include <opencv2/opencv.hpp>
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Decodes live view JPEGs on its own thread, so whoever is talking
+// to the camera only has to copy the bytes in. JPEGs are decoded
+// straight to gray (libjpeg skips the colour conversion) and can be
+// downscaled by 2 or 4 in the DCT while they're decoded, which is
+// much cheaper than decoding full size and shrinking afterwards.
+// Only the latest JPEG is kept: if one comes in before the last was
+// started the old one is skipped, so we never fall behind the camera
+class EvfDecoder
+{
+public:
+	// Gets each decoded frame (normalized float gray, from our
+	// pool) on the decode thread, with the tag its JPEG was posted
+	// with. It's only valid for the call
+	using FrameHandler = std::function<void( const cv::Mat& imgFrame, const size_t nTag )>;
+
+	explicit EvfDecoder( FrameHandler fnHandler );
+	~EvfDecoder();
+
+	// Copies a JPEG in to be decoded; nTag goes along to the handler
+	void Post( const void * pData, const size_t uNumBytes, const size_t nTag = 0 );
+
+	// Decode at 1/nDenom size, nDenom is 1, 2 or 4
+	void SetDownscale( const int nDenom );
+
+	// JPEGs that were skipped, failed to decode or whose handler threw
+	size_t GetDroppedCount() const;
+
+private:
+	void threadProc();
+
+	FrameHandler m_fnHandler;
+	std::atomic<int> m_nDownscale;
+
+	// The latest JPEG, if the decode thread hasn't taken it yet
+	mutable std::mutex m_muJpeg;
+	std::condition_variable m_cvJpeg;
+	std::vector<uint8_t> m_vPending;
+	size_t m_nPendingTag;
+	bool m_bPending;
+	bool m_bQuit;
+	size_t m_nDropped;
+
+	// Decode thread only. The JPEG buffers are swapped
+	// rather than reallocated, and the gray image reused
+	std::vector<uint8_t> m_vDecoding;
+	size_t m_nDecodingTag;
+	cv::Mat m_imgGray;
+	FramePool m_FramePool;
+
+	// Last, so it starts after everything it uses
+	std::thread m_thDecode;
+};
@@ -1,44 +1,111 @@
 #pragma once
 
 #include "Engine.h"
+#include "FramePool.h"
+#include "Noise.h"
+#include <atomic>
 #include <list>
+#include <memory>
+#include <mutex>
 #include <initializer_list>
 
+// Decodes files on worker threads for FileReader
+class FilePrefetcher;
+
 // FileReader class, reads in a list of image files and streams them
 class FileReader : public ImageSource
 {
 	std::list<std::string> m_liFileNames;
+
+	// Gray scratch for colour images
+	img_t m_imgGray;
+
+	// Whether images are binned 2x2 (atomic since the
+	// prefetch workers check it as they load files)
+	std::atomic<bool> m_bBin2x2;
+
+protected:
+	// Returned images come from here, so once the
+	// consumers let go of them the storage is reused
+	// (declared before the prefetcher, which uses it)
+	FramePool m_FramePool;
+
+private:
+	// Decodes files ahead of GetNextImage when prefetching is on
+	std::unique_ptr<FilePrefetcher> m_upPrefetcher;
+
 public:
 	//FileReader( std::initializer_list<std::string> liFileNames ) : m_liFileNames( liFileNames ) {}
+	FileReader( std::list<std::string> liFileNames );
     template<typename C>
-    FileReader( C liFileNames ) : m_liFileNames( liFileNames.begin(), liFileNames.end() ) {}
+    FileReader( C liFileNames ) : FileReader( std::list<std::string>( liFileNames.begin(), liFileNames.end() ) ) {}
+	~FileReader();
+
+	// Decode up to nDepth files ahead of the one being processed,
+	// spread over nWorkers threads. Images still come out in the
+	// order the files were given; a depth of 0 turns it off
+	void SetPrefetch( const size_t nDepth, const size_t nWorkers );
+
+	// Bin images 2x2 (CR2s bin each bayer quad), making a
+	// quarter size frame with less noise for star detection.
+	// Files already being prefetched keep the old setting
+	void SetBin2x2( const bool bBin2x2 );
 
 	ImageSource::Status GetNextImage( img_t * pImg ) override;
 };
 
-// Like above, but a pixel offset can be applied
-// to images (meant to simulate a moving camera)
+// Like above, but the images are moved (meant to simulate a moving
+// camera). Each frame the offset moves by the drift velocity and the
+// rotation by the rotation velocity, and the image is warped that far
+// from where it was with a bilinear warp, so any of it can be sub-pixel.
+// A positive X offset moves the image right, a positive Y offset up;
+// rotation is about the center, in radians. Noise can be added on top
 class FileReader_WithDrift : public FileReader{
-    int m_nOfsX;
-    int m_nOfsY;
-    int m_nDriftVelX;
-    int m_nDriftVelY;
+    // Locked because a processor can steer us from
+    // another thread when the Engine is pipelined
+    mutable std::mutex m_muDrift;
+    float m_fOfsX;
+    float m_fOfsY;
+    float m_fDriftVelX;
+    float m_fDriftVelY;
+    float m_fRotation;
+    float m_fRotationVel;
+    NoiseModel m_Noise;
+    uint64_t m_nNoiseSeed;
+    uint64_t m_nFrame;
+
+#if SH_CUDA
+    // The warp happens on the host
+    cv::Mat m_imgHost;
+    cv::Mat m_imgWarped;
+#endif
 public:
     template<typename C>
     FileReader_WithDrift( C liFileNames ) :
         FileReader( liFileNames ),
-        m_nOfsX( 0 ),
-        m_nOfsY( 0 ),
-        m_nDriftVelX( 0 ),
-        m_nDriftVelY( 0 )
+        m_fOfsX( 0 ),
+        m_fOfsY( 0 ),
+        m_fDriftVelX( 0 ),
+        m_fDriftVelY( 0 ),
+        m_fRotation( 0 ),
+        m_fRotationVel( 0 ),
+        m_nNoiseSeed( 0 ),
+        m_nFrame( 0 )
     {}
 
 	ImageSource::Status GetNextImage( img_t * pImg ) override;
-    void SetDriftVel(int pnDriftX, int pnDriftY);
-    void IncDriftVel( int pnDriftX, int pnDriftY );
-    void GetDriftVel( int * pnDriftX, int * pnDriftY ) const;
-    void SetOffset( int nOfsX, int nOfsY );
-    void GetOffset(int * pnOfsX, int * pnOfsY) const;
+    void SetDriftVel( float fDriftX, float fDriftY );
+    void IncDriftVel( float fDriftX, float fDriftY );
+    void GetDriftVel( float * pfDriftX, float * pfDriftY ) const;
+    void SetOffset( float fOfsX, float fOfsY );
+    void GetOffset( float * pfOfsX, float * pfOfsY ) const;
+    void SetRotation( float fRotation );
+    void SetRotationVel( float fRotationVel );
+    float GetRotation() const;
+
+    // Noise added to every frame; frame N's noise comes from
+    // nSeed and N, so a run can be repeated exactly
+    void SetNoise( const NoiseModel& noise, uint64_t nSeed );
 };
 
 // Defined in a kernel for cuda
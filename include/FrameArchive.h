@@ -0,0 +1,115 @@
+#pragma once
+
+#include "Engine.h"
+#include "FramePool.h"
+
+#include <stdint.h>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Frame archives hold already decoded frames, so a dataset can be
+// replayed without going through imread or LibRaw every time.
+//
+// The file is a header, the frames, then an index saying where each
+// frame is and what it looks like. Frames are stored row after row
+// with no padding, starting on 64 byte boundaries so they can be
+// used in place once the file is mapped. Frames are either CV_32FC1
+// or CV_16UC1 (normalized the same way FileReader normalizes pngs)
+
+// Where a frame is in the file and what it looks like
+struct FrameArchiveEntry
+{
+	uint64_t nOffset;
+	int32_t nRows;
+	int32_t nCols;
+	int32_t nType;
+	int32_t nReserved;
+};
+
+// Image processor that appends every frame it handles to an archive,
+// so running any source through an Engine with one of these records
+// it. The index is written on Finalize (or when it's destroyed)
+class FrameArchiveWriter : public ImageProcessor
+{
+public:
+	// If b16Bit is set frames are stored as CV_16UC1, which
+	// halves the file at the cost of some precision
+	FrameArchiveWriter( const std::string& strFileName, const bool b16Bit = false );
+	~FrameArchiveWriter();
+
+	bool HandleImage( const img_t& img ) override;
+	void Finalize() override;
+
+	// Appends a host CV_32FC1 frame (HandleImage downloads into this)
+	void Append( const cv::Mat& imgFrame );
+
+private:
+	std::ofstream m_fsOut;
+	bool m_b16Bit;
+	uint64_t m_nOffset;
+	cv::Mat m_imgFrame;
+#if SH_CUDA
+	cv::Mat m_imgDownload;
+#endif
+
+	std::vector<FrameArchiveEntry> m_vIndex;
+};
+
+// Image source that maps an archive into memory and hands out its
+// frames in order. Float frames are returned as mats pointing right
+// at the mapping, so nothing is read or copied until the pixels are
+// touched; 16 bit frames are converted into pooled float images.
+// The mapping is copy on write, so a processor that writes to a
+// frame only changes its own copy of those pages. Under CUDA every
+// frame has to be uploaded, so there's always a copy
+class FrameArchiveReader : public ImageSource
+{
+public:
+	// How the frames are going to be read, which we pass on to the
+	// OS as a paging hint. Sequential is whole frames front to back
+	// (read ahead, drop what's behind), Scattered is a bit of every
+	// frame at a time, like GetFrameView callers stacking bands
+	enum class Access
+	{
+		Sequential,
+		Scattered
+	};
+
+	FrameArchiveReader( const std::string& strFileName, const Access eAccess = Access::Sequential );
+	~FrameArchiveReader();
+
+	ImageSource::Status GetNextImage( img_t * pImg ) override;
+
+	// Start from the first frame again (handy for tuning runs)
+	void Rewind();
+	size_t GetFrameCount() const;
+
+	// A host mat looking right at frame nFrame in the mapping (as
+	// stored, so CV_32FC1 or CV_16UC1). Pages are only read in as
+	// they're touched, so a few rows of many frames can be read
+	// without the rest of them. Valid as long as the reader is
+	cv::Mat GetFrameView( const size_t nFrame ) const;
+
+private:
+	// Mapped frames are only valid while the file
+	// is, so these can't be copied or moved around
+	FrameArchiveReader( const FrameArchiveReader& ) = delete;
+	FrameArchiveReader& operator=( const FrameArchiveReader& ) = delete;
+
+	uint8_t * m_pMapped;
+	size_t m_nMappedSize;
+#ifdef WIN32
+	void * m_hFile;
+	void * m_hMapping;
+#endif
+
+	const FrameArchiveEntry * m_pIndex;
+	size_t m_nFrames;
+	size_t m_nNextFrame;
+
+	FramePool m_FramePool;
+#if SH_CUDA
+	cv::Mat m_imgConverted;
+#endif
+};
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "Engine.h"
+
+#include <mutex>
+#include <vector>
+
+// A handful of frame buffers that an ImageSource hands out
+// instead of making new images for every frame. The buffers
+// are reference counted like any other image, so whoever's
+// done with a frame hands it back just by letting it go; once
+// the pool holds the only reference it can be given out again.
+// If every buffer is still in use Get makes a new image that
+// isn't pooled, so a slow consumer costs allocations, not frames
+class FramePool
+{
+public:
+	explicit FramePool( const size_t nMaxBuffers = 4 );
+
+	// Returns an image of the given size and type (its contents
+	// are whatever was left in it). Buffers that match are reused
+	// first, then free buffers of another size are remade
+	img_t Get( const cv::Size szFrame, const int nType );
+
+	// Sources that keep several frames in flight should make
+	// room for them; going down lets go of the extra buffers
+	void SetMaxBuffers( const size_t nMaxBuffers );
+
+	// Number of times Get had to allocate
+	size_t GetAllocCount() const;
+
+private:
+	static bool isFree( const img_t& img );
+
+	mutable std::mutex m_muPool;
+	std::vector<img_t> m_vBuffers;
+	size_t m_nMaxBuffers;
+	size_t m_nAllocated;
+};
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "Engine.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+// Bounded ring of frames handed from one thread to another
+// One thread pushes, one pops. Frames are copied into slots
+// that get swapped with the consumer's image, so once the
+// slots have been sized nothing is allocated per frame
+class FrameQueue
+{
+public:
+	// What Push does when the ring is full
+	enum class Policy
+	{
+		Block,		// Wait for the consumer (backpressure)
+		DropOldest	// Throw away the oldest queued frame
+	};
+
+	FrameQueue( const size_t nCapacity, const Policy ePolicy );
+
+	// Copies img into the ring, returns false if the queue was closed
+	bool Push( const img_t& img );
+
+	// Swaps the oldest frame into pImg. Returns WAIT if nothing
+	// showed up within tTimeout and DONE once closed and drained
+	ImageSource::Status Pop( img_t * pImg, const std::chrono::milliseconds tTimeout );
+
+	// Wakes everyone up; Push fails from now on,
+	// and Pop returns what's left before DONE
+	void Close();
+	bool IsClosed() const;
+
+	// Number of frames dropped by DropOldest
+	size_t GetDropCount() const;
+
+private:
+	std::vector<img_t> m_vSlots;
+	size_t m_nFirst;	// Oldest queued slot
+	size_t m_nCount;	// Number of queued slots
+	size_t m_nDropped;
+	Policy m_ePolicy;
+	bool m_bClosed;
+
+	mutable std::mutex m_muQueue;
+	std::condition_variable m_cvFrame;	// Signalled on push / close
+	std::condition_variable m_cvSpace;	// Signalled on pop / close
+};
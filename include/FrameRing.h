@@ -0,0 +1,94 @@
+#pragma once
+
+#include "Engine.h"
+
+#include <atomic>
+#include <vector>
+
+// Padding we keep either side of each index the two threads hit
+const size_t kFrameRingPad = 64;
+
+// A T with a cache line's worth of padding either side, so nothing
+// else shares its line. We pad rather than use alignas( 64 ) because
+// the ring lives on the heap inside SHCamera, and before C++17's
+// aligned new nothing makes operator new honour that alignment
+template <typename T>
+struct FrameRingPadded
+{
+	char acPadBefore[kFrameRingPad];
+	T value;
+	char acPadAfter[kFrameRingPad];
+
+	template <typename U>
+	explicit FrameRingPadded( const U u ) : value( u ) {}
+};
+
+// Fixed capacity, lock free ring of frames between one producer
+// thread and one consumer thread. When it's full the oldest frame
+// is overwritten (and counted as dropped), so the consumer always
+// gets the most recent frames.
+//
+// The frames live in a pool of preallocated buffers, and the ring
+// itself only passes buffer indices around. A buffer belongs to
+// exactly one of the producer, the ring, the consumer or the free
+// list at a time, so neither side ever touches the other's pixels.
+//
+// Frames can be stamped with a generation when they're pushed, and
+// Pop skips any older than the generation the consumer asks for, so
+// a producer's stale frames can be thrown out without either side
+// having to clear the ring at just the right moment
+class FrameRing
+{
+public:
+	explicit FrameRing( const size_t nCapacity );
+
+	// Producer: get the buffer to write the next frame into, then
+	// publish it as part of nGeneration (dropping the oldest frame
+	// if we're full)
+	img_t& BeginPush();
+	void EndPush( const size_t nGeneration = 0 );
+
+	// Consumer: points pImg at the oldest frame from nMinGeneration on,
+	// throwing out any older ones, and returns false if there isn't one.
+	// The frame stays valid until the next Pop or Clear
+	bool Pop( img_t * pImg, const size_t nMinGeneration = 0 );
+
+	// Consumer: throw away everything queued
+	void Clear();
+
+	bool Empty() const;
+	size_t GetPushCount() const;
+	size_t GetDropCount() const;
+
+private:
+	bool dropOldest( int * pnBuffer );
+	int acquireBuffer();
+	void releaseBuffer( const int nBuffer );
+
+	const size_t m_nCapacity;
+	std::vector<img_t> m_vBuffers;
+
+	// The generation of the frame in each buffer, which
+	// (like its pixels) only the buffer's owner touches
+	std::vector<size_t> m_vGenerations;
+
+	// Queued buffer indices; the producer writes at m_nHead and the
+	// consumer reads at m_nTail. The producer also advances m_nTail
+	// to drop frames, so both sides claim frames with a CAS on it
+	std::vector<std::atomic<int>> m_vQueued;
+	FrameRingPadded<std::atomic<size_t>> m_nHead;
+	FrameRingPadded<std::atomic<size_t>> m_nTail;
+
+	// Buffers the consumer is done with, handed back to the producer
+	std::vector<std::atomic<int>> m_vFree;
+	FrameRingPadded<std::atomic<size_t>> m_nFreeHead;
+	FrameRingPadded<std::atomic<size_t>> m_nFreeTail;
+
+	// Stats
+	FrameRingPadded<std::atomic<size_t>> m_nPushed;
+	std::atomic<size_t> m_nDropped;
+
+	// Only touched by their own threads
+	FrameRingPadded<int> m_nProducerBuffer;
+	FrameRingPadded<int> m_nConsumerBuffer;
+};
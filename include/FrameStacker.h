@@ -0,0 +1,65 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+#include <vector>
+
+// Stacks a stream of float frames over a sliding window of the last
+// nWindow of them. The window's frames are kept in a ring next to
+// running sums, so each new frame adds itself and takes the oldest
+// one out in a single pass rather than the window being re-summed.
+//
+// In SigmaClip mode each pixel of a new frame is checked against the
+// mean and deviation of the window it's joining; if it's more than
+// fClipSigma deviations out (a satellite, a hot pixel) it's left out
+// of the clipped mean until it leaves the window. That's decided once
+// per frame, so it's not quite an iterated sigma clip, but it's O(1)
+// per pixel per frame however big the window is
+class FrameStacker
+{
+public:
+	enum class Mode
+	{
+		Mean,		// Plain mean of the window
+		SigmaClip	// Mean of the pixels that weren't outliers
+	};
+
+	FrameStacker( const size_t nWindow = 1, const Mode eMode = Mode::Mean, const float fClipSigma = 3.f );
+
+	// Changing these starts the stack over
+	void SetWindow( const size_t nWindow, const Mode eMode, const float fClipSigma = 3.f );
+	void Reset();
+
+	// Adds a CV_32FC1 frame, pushing out the oldest once the window is
+	// full. A frame of a different size from the last starts over
+	void Push( const cv::Mat& img );
+
+	// Writes the stack so far into imgStacked (as CV_32FC1)
+	void GetStacked( cv::Mat& imgStacked ) const;
+
+	// Number of frames in the window right now
+	size_t GetCount() const;
+	size_t GetWindow() const;
+	Mode GetMode() const;
+
+private:
+	size_t m_nWindow;
+	Mode m_eMode;
+	float m_fClipSigma;
+
+	cv::Size m_szFrame;
+	size_t m_nCount;
+	size_t m_nNext;		// Ring slot the next frame goes in
+
+	// The window's frames, and in SigmaClip mode
+	// which of their pixels went into the clipped sum
+	std::vector<cv::Mat> m_vFrames;
+	std::vector<cv::Mat> m_vAccepted;
+
+	// Running sums (double, so adding and taking out
+	// frames forever doesn't accumulate error)
+	cv::Mat m_imgSum;
+	cv::Mat m_imgSumSq;
+	cv::Mat m_imgClipSum;
+	cv::Mat m_imgClipCount;
+};
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "StarFinder.h"
+#include "StarRegistration.h"
+#include "FrameArchive.h"
+
+#include <memory>
+#include <string>
+
+// Stacks a sequence of frames (i.e. what TRACK mode captured) into
+// one image. Each frame's stars are registered against the first
+// frame's, and the frame is warped onto it and spilled to a scratch
+// frame archive, so memory doesn't grow with the number of frames.
+// On Finalize the archive is mapped and combined a band of rows at a
+// time, bands in parallel, so only the rows being combined have to be
+// read in. Pixels a warped frame doesn't cover are left out of the
+// stack there, as are frames that won't register
+class ImageStacker : public StarFinder
+{
+public:
+	enum class Integration
+	{
+		Mean,
+		SigmaClip,	// Mean after repeatedly dropping values fClipSigma deviations from the median
+		Median
+	};
+
+	// The stack is written to strOutputFile as a 16 bit image when we're
+	// finalized (unless it's empty); strScratchFile holds the registered
+	// frames until then, and is removed once they've been combined
+	ImageStacker( const std::string& strOutputFile, const std::string& strScratchFile,
+				  const Integration eIntegration = Integration::SigmaClip, const float fClipSigma = 3.f );
+	~ImageStacker();
+
+	bool HandleImage( const img_t& img ) override;
+	void Finalize() override;
+
+	// The stack (CV_32FC1), once we've been finalized
+	const cv::Mat& GetStacked() const;
+
+	// Frames that went into the stack, and ones that were left out
+	size_t GetStackedCount() const;
+	size_t GetRejectedCount() const;
+
+private:
+	std::string m_strOutputFile;
+	std::string m_strScratchFile;
+	Integration m_eIntegration;
+	float m_fClipSigma;
+
+	// Made from the first frame with enough stars, which
+	// is the one everything else is warped onto
+	std::unique_ptr<StarRegistration> m_upRegistration;
+	cv::Size m_szFrame;
+
+	std::unique_ptr<FrameArchiveWriter> m_upScratch;
+	size_t m_nStacked;
+	size_t m_nRejected;
+
+#if SH_CUDA
+	cv::Mat m_imgHost;
+#endif
+	cv::Mat m_imgWarped;
+	cv::Mat m_imgStacked;
+
+	void combine( const FrameArchiveReader& frames );
+};
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+#include <stdint.h>
+
+// Sensor noise for simulated frames, in the normalized
+// units frames are in (where 1 is full scale)
+struct NoiseModel
+{
+	float fReadNoise;	// Sigma of the gaussian noise every pixel gets
+	float fFullWell;	// Electrons at full scale, for shot noise (0 is none)
+
+	NoiseModel( const float fReadNoise = 0, const float fFullWell = 0 ) :
+		fReadNoise( fReadNoise ),
+		fFullWell( fFullWell )
+	{}
+
+	bool IsNone() const { return fReadNoise <= 0 && fFullWell <= 0; }
+};
+
+// Adds noise to a CV_32FC1 image. Shot noise is drawn as gaussian with
+// the poisson variance, which is close enough past a few electrons. The
+// noise only depends on nSeed (not on the threads or the machine), so
+// the same seed gives the same frame
+void AddNoise( cv::Mat& img, const NoiseModel& noise, const uint64_t nSeed );
+
+// Small, fast random numbers that only depend on their seed,
+// for things that have to come out the same everywhere
+class SplitMix64
+{
+	uint64_t m_nState;
+
+public:
+	SplitMix64( const uint64_t nSeed ) : m_nState( nSeed ) {}
+
+	uint64_t Next()
+	{
+		uint64_t z = ( m_nState += 0x9e3779b97f4a7c15ull );
+		z = ( z ^ ( z >> 30 ) ) * 0xbf58476d1ce4e5b9ull;
+		z = ( z ^ ( z >> 27 ) ) * 0x94d049bb133111ebull;
+		return z ^ ( z >> 31 );
+	}
+
+	// Uniform in [0, 1)
+	float Uniform()
+	{
+		return ( Next() >> 40 ) * ( 1.f / ( 1 << 24 ) );
+	}
+};
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "Engine.h"
+#include "Circle.h"
+#include "FramePool.h"
+#include "Noise.h"
+
+#include <stdint.h>
+#include <vector>
+
+// What a StarFieldSource renders. Positions are in image
+// pixels (y down) and intensities are normalized, 1 being
+// full scale (anything brighter saturates there)
+struct StarFieldParams
+{
+	cv::Size szFrame = cv::Size( 1024, 768 );
+	size_t nFrames = 10;
+	uint64_t nSeed = 1;
+
+	// Stars are placed uniformly over the first frame, with peak
+	// intensities log uniform between these (so most are faint)
+	size_t nStars = 200;
+	float fMinPeak = 0.05f;
+	float fMaxPeak = 0.9f;
+
+	// Gaussian PSF, integrated over each pixel
+	float fFWHM = 5.f;
+
+	// Sky level at the center of the frame and how
+	// much it changes per pixel across / down it
+	float fBackground = 0.05f;
+	float fGradientX = 0;
+	float fGradientY = 0;
+
+	NoiseModel noise = NoiseModel( 0.005f, 20000.f );
+
+	// Sensor defects, which stay put while the sky moves
+	float fHotPixelFraction = 0;
+	float fHotPixelValue = 1.f;
+
+	// How far the sky moves every frame, and how
+	// far it turns (radians, about the center)
+	float fDriftX = 0;
+	float fDriftY = 0;
+	float fRotation = 0;
+};
+
+// Image source that renders star fields from StarFieldParams, so the
+// star finder can be loaded up with however many stars and pixels we
+// like and its results checked against where the stars really were.
+// Frames are rendered in bands of rows on all threads, and only depend
+// on the seed, so a run can be repeated exactly anywhere
+class StarFieldSource : public ImageSource
+{
+public:
+	StarFieldSource( const StarFieldParams& params );
+
+	ImageSource::Status GetNextImage( img_t * pImg ) override;
+
+	// Start from the first frame again
+	void Rewind();
+
+	// Where the stars are in frame nFrame (fR is their FWHM),
+	// in the order they were made, not by brightness
+	std::vector<Circle> GetStars( const size_t nFrame ) const;
+
+	// How the sky moved from the first frame to frame nFrame; the
+	// shift is that of the frame's center, the rotation is about it
+	void GetMotion( const size_t nFrame, float * pfShiftX, float * pfShiftY, float * pfRotation ) const;
+
+	// Renders frame nFrame into imgFrame (CV_32FC1, made if needed)
+	void Render( const size_t nFrame, cv::Mat& imgFrame ) const;
+
+private:
+	StarFieldParams m_Params;
+	size_t m_nNextFrame;
+
+	// Where the stars are in the first frame, and how bright (total
+	// flux, which is what the pixels covering a star add up to)
+	std::vector<Circle> m_vStars;
+	std::vector<float> m_vFlux;
+
+	// Hot pixels as ( pixel index, value ), sorted by index
+	std::vector<std::pair<size_t, float>> m_vHotPixels;
+
+	FramePool m_FramePool;
+#if SH_CUDA
+	cv::Mat m_imgRender;
+#endif
+};
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+#include <memory>
+#include <vector>
+
+// CPU filter engines used by StarFinder. These work
+// on host mats only, so the CUDA build keeps using
+// the cv::cuda filter chain in StarFinder.cpp
+
+// Half widths of the disks OpenCV rasterizes for our kernels,
+// one per row from -nRadius to nRadius. We measure them from
+// the real masks so the results match the cv:: filters exactly
+std::vector<int> GetCircleHalfWidths( const int nRadius );	// cv::circle, filled (top hat)
+std::vector<int> GetEllipseHalfWidths( const int nRadius );	// MORPH_ELLIPSE (dilation)
+
+// Mean over the filled disk cv::circle draws at nRadius, which is
+// what DoTophatFilter's normalized kernel computes with filter2D
+// (reflected borders). The disk is summed as shifted column sums,
+// so the work per pixel is ~4 * nRadius adds instead of one MAC
+// per kernel element, and the rows involved stay in cache
+void DiskMeanFilter( const int nRadius, const cv::Mat& input, cv::Mat& output );
+
+// Max over the MORPH_ELLIPSE disk of nRadius, which is what
+// DoDilationFilter gets from cv::dilate (pixels outside the
+// image are ignored). Built from bands of equal width rows,
+// each a vertical max and a van Herk/Gil-Werman running max,
+// so it doesn't visit every element of the disk per pixel
+void DiskMaxFilter( const int nRadius, const cv::Mat& input, cv::Mat& output );
+
+// Fused implementation of the StarFinder::findStars chain.
+// The gaussian, top hat, peak, threshold, dilation and local
+// max stages are all computed row by row inside cache sized
+// tiles, so each input pixel only comes from memory once and
+// nothing but the boolean star image is written back.
+// Radii and sigma are in pixels, like the Do*Filter functions.
+// Kernels and scratch are kept between calls, so once the
+// parameters settle Apply doesn't touch the heap
+struct _FusedStarFilter_impl;
+class FusedStarFilter
+{
+	std::unique_ptr<_FusedStarFilter_impl> m_pImpl;
+public:
+	FusedStarFilter();
+	~FusedStarFilter();
+
+	void Apply( const cv::Mat& input, const int nFilterRadius, const int nDilationRadius,
+				const double dSigma, const float fIntensityThreshold, cv::Mat& imgBoolean );
+};
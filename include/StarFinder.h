@@ -1,26 +1,42 @@
 #include "Engine.h"
+#include "Circle.h"
+#include "StarFilter.h"
 
+#include <list>
 #include <memory>
 #include <vector>
 #include <utility>
 
 #include <opencv2/opencv.hpp>
 
-// Circle struct - made my
-// own so it can be constructed
-// in host and device code
-struct Circle
+// The buffers findStars uses for one frame size. The stage
+// images are only needed by the per-stage chain, so they're
+// created the first time that runs; the fused filter keeps
+// its own scratch. Once made none of these are reallocated
+struct StarFinderWorkspace
 {
-	float fX;	// x pos
-	float fY;	// y pos
-	float fR;	// radius
+	cv::Size szFrame;
+	img_t imgInput;
+	img_t imgGaussian;
+	img_t imgTopHat;
+	img_t imgPeak;
+	img_t imgThreshold;
+	img_t imgDilated;
+	img_t imgLocalMax;
+	img_t imgStars;
+	img_t imgBoolean;
+#if !SH_CUDA
+	FusedStarFilter fusedFilter;
+#endif
+
+	StarFinderWorkspace( const cv::Size szFrame );
 };
 
 // Base star finder class
 // All it's for is calling findStars,
 // which performs the signal processing
-// and leaves m_dBoolImg with a byte
-// image where nonzero pixels are stars
+// and leaves m_pWorkspace->imgBoolean with
+// a byte image where nonzero pixels are stars
 class StarFinder : public ImageProcessor
 {
 protected:
@@ -30,28 +46,53 @@ protected:
 	float m_fHWHM;
 	float m_fIntensityThreshold;
 
-	// The images we use and their size
-	img_t m_imgInput;
-	img_t m_imgGaussian;
-	img_t m_imgTopHat;
-	img_t m_imgPeak;
-	img_t m_imgThreshold;
-	img_t m_imgDilated;
-	img_t m_imgLocalMax;
-	img_t m_imgStars;
-	img_t m_imgBoolean;
-	img_t m_imgTmp;
+	// How much the frames we get are binned by (i.e. 2 for 2x2).
+	// The filter and dilation radii are fractions of the width, but
+	// they're capped (as are the HWHM and star radius) in unbinned
+	// pixels, so the helpers scale everything down by the binning
+	int m_nBinning;
+	float getHWHM() const;
+	float getStarRadius() const;
+	int getFilterRadius( const int nCols ) const;
+	int getDilationRadius( const int nCols ) const;
+
+	// Use the fused CPU filter rather than
+	// running each stage over the whole image
+	bool m_bUseFusedFilter;
+
+	// If true we filter the caller's image directly (it's
+	// only read), otherwise it's copied into imgInput
+	bool m_bBorrowInput;
+
+	// Workspaces for the frame sizes we've seen recently, most
+	// recent first, so switching resolution (i.e. live view and
+	// full frames) doesn't reallocate everything each time
+	std::list<std::unique_ptr<StarFinderWorkspace>> m_liWorkspaces;
+	size_t m_nMaxWorkspaces;
+
+	// The workspace for the last image we handled
+	StarFinderWorkspace * m_pWorkspace;
+	StarFinderWorkspace * getWorkspace( const cv::Size szFrame );
 
 	// Leaves bool image with star locations
-	bool findStars( img_t& img );
+	bool findStars( const img_t& img );
+
+	// After findStars, turns the bool image into star positions
+	// centroided in hImg (a host copy of the image), brightest first
+	std::vector<Circle> locateStars( const cv::Mat& hImg );
 
 public:
 	// TODO work out some algorithm parameters,
 	// it's all hardcoded nonsense right now
 	StarFinder();
 
-	bool HandleImage( img_t img ) override;
+	bool HandleImage( const img_t& img ) override;
 
+	// Tell us the source bins its frames (see FileReader::SetBin2x2);
+	// positions and drift are then in binned pixels
+	void SetBinning( const int nBinning );
+	void SetUseFusedFilter( bool bUseFused );
+	void SetBorrowInput( bool bBorrow );
 };
 
 // UI implementation - pops opencv window
@@ -61,7 +102,7 @@ class StarFinder_UI : public StarFinder
 {
 public:
 	StarFinder_UI();
-	bool HandleImage( img_t img ) override;
+	bool HandleImage( const img_t& img ) override;
 };
 
 // Implementation that computes the average
@@ -81,7 +122,7 @@ class StarFinder_Drift : public StarFinder
 	std::vector<Circle> m_vLastCircles;
 public:
 	StarFinder_Drift();
-	bool HandleImage( img_t img ) override;
+	bool HandleImage( const img_t& img ) override;
     bool GetDrift_Prev( float * pDriftX, float * pDriftY ) const;
     bool GetDrift_Cumulative( float * pDriftX, float * pDriftY ) const;
 };
@@ -96,7 +137,7 @@ class StarFinder_ImgOffset : public StarFinder_Drift
 
 public:
     StarFinder_ImgOffset( FileReader_WithDrift * pFileReader);
-    bool HandleImage( img_t img ) override;
+    bool HandleImage( const img_t& img ) override;
 };
 
 #if SH_TELESCOPE && SH_CAMERA
@@ -139,5 +180,15 @@ private:
 // Finds overlapping circles and combines them
 std::vector<Circle> CollapseCircles( const std::vector<Circle>& vInput );
 
+// Matches stars between frames: returns (old, new) index pairs of
+// overlapping stars that are each other's nearest neighbour
+std::vector<std::pair<int, int>> MatchStars( const std::vector<Circle>& vOld, const std::vector<Circle>& vNew );
+
+// Moves each star to the intensity weighted centroid of the (background
+// subtracted) image within nRadius of it, giving sub-pixel positions
+void RefineCentroids( const cv::Mat& img, const int nRadius, std::vector<Circle>& vStars );
+
 // Takes in boolean star image and returns a vector of stars as circles
+// On the host every connected blob of pixels is one star; the CUDA
+// version makes a circle per pixel and collapses the overlapping ones
 std::vector<Circle> FindStarsInImage( float fStarRadius, img_t& dBoolImg );
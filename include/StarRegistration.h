@@ -0,0 +1,53 @@
+#pragma once
+
+#include "Circle.h"
+
+#include <vector>
+
+// Similarity transform taking star positions in
+// one frame to where they are in another
+struct StarTransform
+{
+	float fScale;
+	float fRotation;	// radians
+	float fTransX;
+	float fTransY;
+
+	Circle Apply( const Circle c ) const;
+};
+
+// Registers star fields against a reference field with triangles
+// of bright stars. A triangle's side ratios don't change when it's
+// shifted, rotated or scaled, so matching triangles vote for a
+// transform no matter how far the field moved between frames.
+// Star vectors are expected brightest first
+class StarRegistration
+{
+public:
+	// A triangle of stars; vertices are ordered by the
+	// length of the side opposite them, shortest first
+	struct Triangle
+	{
+		int aVertices[3];
+		float fMidRatio;	// middle side / longest side
+		float fMinRatio;	// shortest side / longest side
+		bool bCounterClockwise;
+	};
+
+private:
+	int m_nMaxStars;
+	std::vector<Circle> m_vRefStars;
+	std::vector<Triangle> m_vRefTriangles;
+
+	// Reference triangles sorted by descriptor bin,
+	// as ( bin, triangle index ) pairs
+	std::vector<std::pair<int, int>> m_vRefIndex;
+
+public:
+	// Triangles are made from the nMaxStars brightest stars
+	StarRegistration( const std::vector<Circle>& vRefStars, const int nMaxStars = 25 );
+
+	// Finds the transform taking reference stars to vStars,
+	// returns false if not enough of them agree on one
+	bool Register( const std::vector<Circle>& vStars, StarTransform * pTransform ) const;
+};
@@ -64,6 +64,7 @@ make_function( T *t )
 using img_t = cv::cuda::GpuMat;
 #include <opencv2/cudaimgproc.hpp>
 #include <opencv2/cudaarithm.hpp>
+#include <opencv2/cudawarping.hpp>
 #else
 using img_t = cv::Mat;
 #endif
@@ -75,12 +76,14 @@ using cv::cuda::exp;
 using cv::cuda::threshold;
 using cv::cuda::subtract;
 using cv::cuda::cvtColor;
+using cv::cuda::resize;
 #else
 using cv::max;
 using cv::exp;
 using cv::threshold;
 using cv::subtract;
 using cv::cvtColor;
+using cv::resize;
 #endif
 
 // Arbitrarily small number
@@ -88,8 +91,9 @@ const double kEPS = .001;
 
 #if SH_CAMERA
 // Open a raw image file, implemented in filereader.cpp
-img_t Raw2Img( void * pData, size_t uNumBytes );
-img_t Raw2Img( std::string strFileName );	
+// If bBin2x2 is set each 2x2 bayer quad becomes one pixel
+img_t Raw2Img( void * pData, size_t uNumBytes, const bool bBin2x2 = false );
+img_t Raw2Img( std::string strFileName, const bool bBin2x2 = false );
 #endif
 
 // Display image with opencv (define both cv and gpu)
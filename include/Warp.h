@@ -0,0 +1,19 @@
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+// Bilinear affine warp of a CV_32FC1 image into imgDst (made the size
+// of szDst if it isn't already, so a pooled image is written in place).
+// Each pixel ( x, y ) of imgDst samples imgSrc at
+//   ( adInvMap[0] x + adInvMap[1] y + adInvMap[2],
+//     adInvMap[3] x + adInvMap[4] y + adInvMap[5] )
+// which is the map warpAffine takes with WARP_INVERSE_MAP. Samples off
+// the image read fBorder (NaN is fine, a sample landing exactly on the
+// last row or column doesn't touch what's past it). Rows are spread over
+// threads and vectorized, with AVX2 used if the CPU has it
+void WarpAffineBilinear( const cv::Mat& imgSrc, const double adInvMap[6], const float fBorder, const cv::Size szDst, cv::Mat& imgDst );
+
+// The inverse map of moving an image by ( fShiftX, fShiftY ) pixels and
+// rotating it fRotation radians about its center (clockwise on screen,
+// since y goes down), for an image of size szImage
+void GetShiftRotateMap( const cv::Size szImage, const float fShiftX, const float fShiftY, const float fRotation, double adInvMap[6] );
@@ -0,0 +1,298 @@
+#include "Bayer.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <stdint.h>
+#include <string.h>
+
+#if defined( __x86_64__ ) || defined( _M_X64 ) || defined( __i386__ ) || defined( _M_IX86 )
+#define SH_BAYER_X86 1
+#include <immintrin.h>
+#elif defined( __ARM_NEON ) || defined( __ARM_NEON__ )
+#define SH_BAYER_NEON 1
+#include <arm_neon.h>
+#endif
+
+// Luma weights, as cvtColor uses them
+const float kR2Y = 0.299f;
+const float kG2Y = 0.587f;
+const float kB2Y = 0.114f;
+
+// Weights of the center pixel, its left + right neighbours, the ones
+// above + below and the four diagonals for one column parity of a row
+struct BayerWeights
+{
+	float fCenter;
+	float fHorz;
+	float fVert;
+	float fDiag;
+};
+
+void BayerToGray( const cv::Mat& imgBayer, const float fScale, const float fThreshold, cv::Mat& imgGray )
+{
+	if ( imgBayer.type() != CV_16UC1 )
+		throw std::runtime_error( "Error: BayerToGray needs 16 bit bayer data!" );
+	if ( imgBayer.rows < 3 || imgBayer.cols < 3 )
+		throw std::runtime_error( "Error: Bayer image too small to debayer!" );
+
+	imgGray.create( imgBayer.size(), CV_32FC1 );
+	const int nRows = imgBayer.rows;
+	const int nCols = imgBayer.cols;
+
+	// At a red or blue pixel the other colour is the average of the diagonals
+	// and green the average of the 4 neighbours; at a green pixel the colours
+	// come from the pairs of neighbours on either side. Red rows are even
+	const BayerWeights aWeights[2][2] = {
+		{ { kR2Y, kG2Y / 4, kG2Y / 4, kB2Y / 4 }, { kG2Y, kR2Y / 2, kB2Y / 2, 0 } },	// RGRG...
+		{ { kG2Y, kB2Y / 2, kR2Y / 2, 0 }, { kB2Y, kG2Y / 4, kG2Y / 4, kR2Y / 4 } }	// GBGB...
+	};
+
+#pragma omp parallel for
+	for ( int y = 1; y < nRows - 1; y++ )
+	{
+		const uint16_t * pUp = imgBayer.ptr<uint16_t>( y - 1 );
+		const uint16_t * pMid = imgBayer.ptr<uint16_t>( y );
+		const uint16_t * pDown = imgBayer.ptr<uint16_t>( y + 1 );
+		float * pOut = imgGray.ptr<float>( y );
+
+		// Fold the scale into the weights, and store the odd column
+		// ones as the difference from the even ones (see below)
+		const BayerWeights w0 = aWeights[y & 1][0];
+		const BayerWeights w1 = aWeights[y & 1][1];
+		const float fC = fScale * w0.fCenter, fdC = fScale * ( w1.fCenter - w0.fCenter );
+		const float fH = fScale * w0.fHorz, fdH = fScale * ( w1.fHorz - w0.fHorz );
+		const float fV = fScale * w0.fVert, fdV = fScale * ( w1.fVert - w0.fVert );
+		const float fD = fScale * w0.fDiag, fdD = fScale * ( w1.fDiag - w0.fDiag );
+
+		// Every pixel does the same sums and the weights just switch
+		// with the column parity, so picking them arithmetically rather
+		// than with a branch leaves nothing stopping this vectorizing
+#pragma omp simd
+		for ( int x = 1; x < nCols - 1; x++ )
+		{
+			const float fOdd = float( x & 1 );
+			const float fHorz = float( pMid[x - 1] ) + float( pMid[x + 1] );
+			const float fVert = float( pUp[x] ) + float( pDown[x] );
+			const float fDiag = float( pUp[x - 1] ) + float( pUp[x + 1] ) + float( pDown[x - 1] ) + float( pDown[x + 1] );
+			const float fGray = ( fC + fOdd * fdC ) * float( pMid[x] ) + ( fH + fOdd * fdH ) * fHorz +
+				( fV + fOdd * fdV ) * fVert + ( fD + fOdd * fdD ) * fDiag;
+			pOut[x] = fGray > fThreshold ? fGray : 0.f;
+		}
+
+		pOut[0] = pOut[1];
+		pOut[nCols - 1] = pOut[nCols - 2];
+	}
+
+	// Top and bottom rows copy their neighbours
+	memcpy( imgGray.ptr<float>( 0 ), imgGray.ptr<float>( 1 ), nCols * sizeof( float ) );
+	memcpy( imgGray.ptr<float>( nRows - 1 ), imgGray.ptr<float>( nRows - 2 ), nCols * sizeof( float ) );
+}
+
+void BayerBin2x2( const cv::Mat& imgBayer, const float fScale, const float fThreshold, cv::Mat& imgGray )
+{
+	if ( imgBayer.type() != CV_16UC1 )
+		throw std::runtime_error( "Error: BayerBin2x2 needs 16 bit bayer data!" );
+	if ( imgBayer.rows < 2 || imgBayer.cols < 2 )
+		throw std::runtime_error( "Error: Bayer image too small to bin!" );
+
+	imgGray.create( imgBayer.rows / 2, imgBayer.cols / 2, CV_32FC1 );
+	const int nCols = imgGray.cols;
+	const float fQuadScale = fScale / 4;
+
+#pragma omp parallel for
+	for ( int y = 0; y < imgGray.rows; y++ )
+	{
+		const uint16_t * pTop = imgBayer.ptr<uint16_t>( 2 * y );
+		const uint16_t * pBottom = imgBayer.ptr<uint16_t>( 2 * y + 1 );
+		float * pOut = imgGray.ptr<float>( y );
+
+#pragma omp simd
+		for ( int x = 0; x < nCols; x++ )
+		{
+			const float fSum = float( pTop[2 * x] ) + float( pTop[2 * x + 1] ) + float( pBottom[2 * x] ) + float( pBottom[2 * x + 1] );
+			const float fGray = fQuadScale * fSum;
+			pOut[x] = fGray > fThreshold ? fGray : 0.f;
+		}
+	}
+}
+
+// SumBayerChannels kernels. Each does as many whole vectors of
+// pixels as it can and returns how many that was; the rest
+// are left for the scalar loop. Sums wrap at 16 bits, like
+// adding ushorts does, though with one nonzero they can't
+////////////////////////////////////////////////////
+
+static void sumBayerChannels_Scalar( const uint16_t * pChannels, const size_t nPixels, uint16_t * pBayer )
+{
+#pragma omp simd
+	for ( size_t i = 0; i < nPixels; i++ )
+	{
+		const uint16_t uSum = pChannels[4 * i + 0] + pChannels[4 * i + 1] + pChannels[4 * i + 2] + pChannels[4 * i + 3];
+		pBayer[i] = uint16_t( uSum << 2 );
+	}
+}
+
+#if SH_BAYER_X86
+// Each 64 bit lane of these holds one pixel's 4 shorts. Folding the
+// lane in half twice leaves the sum in its low 16 bits, which we sign
+// extend so the saturating pack at the end passes them through as is
+static inline __m128i sumLanes_SSE2( const __m128i v )
+{
+	__m128i x = _mm_add_epi16( v, _mm_srli_epi64( v, 32 ) );
+	x = _mm_add_epi16( x, _mm_srli_epi64( x, 16 ) );
+	x = _mm_srai_epi32( _mm_slli_epi32( x, 16 ), 16 );
+	return _mm_shuffle_epi32( x, _MM_SHUFFLE( 2, 0, 2, 0 ) );
+}
+
+// 8 pixels at a time (SSE2 is always there on x64)
+static size_t sumBayerChannels_SSE2( const uint16_t * pChannels, const size_t nPixels, uint16_t * pBayer )
+{
+	const size_t nVecPixels = nPixels & ~size_t( 7 );
+	for ( size_t i = 0; i < nVecPixels; i += 8 )
+	{
+		const __m128i * pIn = (const __m128i *) ( pChannels + 4 * i );
+		const __m128i s0 = sumLanes_SSE2( _mm_loadu_si128( pIn + 0 ) );
+		const __m128i s1 = sumLanes_SSE2( _mm_loadu_si128( pIn + 1 ) );
+		const __m128i s2 = sumLanes_SSE2( _mm_loadu_si128( pIn + 2 ) );
+		const __m128i s3 = sumLanes_SSE2( _mm_loadu_si128( pIn + 3 ) );
+		const __m128i vSums = _mm_packs_epi32( _mm_unpacklo_epi64( s0, s1 ), _mm_unpacklo_epi64( s2, s3 ) );
+		_mm_storeu_si128( (__m128i *) ( pBayer + i ), _mm_slli_epi16( vSums, 2 ) );
+	}
+	return nVecPixels;
+}
+
+#if defined( __GNUC__ )
+#define SH_BAYER_AVX2 1
+
+// Same idea, 16 pixels at a time. The packs work within 128 bit
+// halves, so the pixels come out in pairs that need putting back
+__attribute__( ( target( "avx2" ) ) )
+static inline __m256i sumLanes_AVX2( const __m256i v )
+{
+	__m256i x = _mm256_add_epi16( v, _mm256_srli_epi64( v, 32 ) );
+	x = _mm256_add_epi16( x, _mm256_srli_epi64( x, 16 ) );
+	x = _mm256_srai_epi32( _mm256_slli_epi32( x, 16 ), 16 );
+	return _mm256_shuffle_epi32( x, _MM_SHUFFLE( 2, 0, 2, 0 ) );
+}
+
+__attribute__( ( target( "avx2" ) ) )
+static size_t sumBayerChannels_AVX2( const uint16_t * pChannels, const size_t nPixels, uint16_t * pBayer )
+{
+	const __m256i vOrder = _mm256_setr_epi32( 0, 4, 1, 5, 2, 6, 3, 7 );
+	const size_t nVecPixels = nPixels & ~size_t( 15 );
+	for ( size_t i = 0; i < nVecPixels; i += 16 )
+	{
+		const __m256i * pIn = (const __m256i *) ( pChannels + 4 * i );
+		const __m256i s0 = sumLanes_AVX2( _mm256_loadu_si256( pIn + 0 ) );
+		const __m256i s1 = sumLanes_AVX2( _mm256_loadu_si256( pIn + 1 ) );
+		const __m256i s2 = sumLanes_AVX2( _mm256_loadu_si256( pIn + 2 ) );
+		const __m256i s3 = sumLanes_AVX2( _mm256_loadu_si256( pIn + 3 ) );
+		const __m256i vPairs = _mm256_packs_epi32( _mm256_unpacklo_epi64( s0, s1 ), _mm256_unpacklo_epi64( s2, s3 ) );
+		const __m256i vSums = _mm256_permutevar8x32_epi32( vPairs, vOrder );
+		_mm256_storeu_si256( (__m256i *) ( pBayer + i ), _mm256_slli_epi16( vSums, 2 ) );
+	}
+	return nVecPixels;
+}
+#endif // __GNUC__
+#endif // SH_BAYER_X86
+
+#if SH_BAYER_NEON
+// NEON can deinterleave on load, so this is easy
+static size_t sumBayerChannels_NEON( const uint16_t * pChannels, const size_t nPixels, uint16_t * pBayer )
+{
+	const size_t nVecPixels = nPixels & ~size_t( 7 );
+	for ( size_t i = 0; i < nVecPixels; i += 8 )
+	{
+		const uint16x8x4_t v = vld4q_u16( pChannels + 4 * i );
+		const uint16x8_t vSum = vaddq_u16( vaddq_u16( v.val[0], v.val[1] ), vaddq_u16( v.val[2], v.val[3] ) );
+		vst1q_u16( pBayer + i, vshlq_n_u16( vSum, 2 ) );
+	}
+	return nVecPixels;
+}
+#endif // SH_BAYER_NEON
+
+using SumBayerChannelsFn = size_t ( * )( const uint16_t *, const size_t, uint16_t * );
+
+// Finds the kernel for eKernel, if we have it. A null kernel
+// is fine, it means the scalar loop does all the work
+static bool getSumBayerChannelsKernel( const BayerKernel eKernel, SumBayerChannelsFn * pfnKernel )
+{
+	*pfnKernel = nullptr;
+	switch ( eKernel )
+	{
+		case BayerKernel::Best:
+#if SH_BAYER_AVX2
+			if ( getSumBayerChannelsKernel( BayerKernel::AVX2, pfnKernel ) )
+				return true;
+#endif
+#if SH_BAYER_X86
+			return getSumBayerChannelsKernel( BayerKernel::SSE2, pfnKernel );
+#elif SH_BAYER_NEON
+			return getSumBayerChannelsKernel( BayerKernel::NEON, pfnKernel );
+#else
+			return true;
+#endif
+		case BayerKernel::Scalar:
+			return true;
+#if SH_BAYER_X86
+		case BayerKernel::SSE2:
+			*pfnKernel = sumBayerChannels_SSE2;
+			return true;
+#endif
+#if SH_BAYER_AVX2
+		case BayerKernel::AVX2:
+			if ( !__builtin_cpu_supports( "avx2" ) )
+				return false;
+			*pfnKernel = sumBayerChannels_AVX2;
+			return true;
+#endif
+#if SH_BAYER_NEON
+		case BayerKernel::NEON:
+			*pfnKernel = sumBayerChannels_NEON;
+			return true;
+#endif
+		default:
+			return false;
+	}
+}
+
+static void sumBayerChannels( const SumBayerChannelsFn fnKernel, const uint16_t * pChannels, const size_t nPixels, uint16_t * pBayer )
+{
+	// Split it into chunks for the threads (a multiple
+	// of every kernel's width, so only the last has a tail)
+	const size_t nChunkPixels = 1 << 14;
+	const int nChunks = int( ( nPixels + nChunkPixels - 1 ) / nChunkPixels );
+
+#pragma omp parallel for
+	for ( int c = 0; c < nChunks; c++ )
+	{
+		const size_t nBegin = c * nChunkPixels;
+		const size_t nCount = std::min( nChunkPixels, nPixels - nBegin );
+		const size_t nDone = fnKernel ? fnKernel( pChannels + 4 * nBegin, nCount, pBayer + nBegin ) : 0;
+		sumBayerChannels_Scalar( pChannels + 4 * ( nBegin + nDone ), nCount - nDone, pBayer + nBegin + nDone );
+	}
+}
+
+// Pick the best kernel for this CPU once
+static SumBayerChannelsFn getBestSumBayerChannelsKernel()
+{
+	SumBayerChannelsFn fnKernel;
+	getSumBayerChannelsKernel( BayerKernel::Best, &fnKernel );
+	return fnKernel;
+}
+
+void SumBayerChannels( const uint16_t * pChannels, const size_t nPixels, uint16_t * pBayer )
+{
+	static const SumBayerChannelsFn fnKernel = getBestSumBayerChannelsKernel();
+	sumBayerChannels( fnKernel, pChannels, nPixels, pBayer );
+}
+
+bool SumBayerChannels( const BayerKernel eKernel, const uint16_t * pChannels, const size_t nPixels, uint16_t * pBayer )
+{
+	SumBayerChannelsFn fnKernel;
+	if ( !getSumBayerChannelsKernel( eKernel, &fnKernel ) )
+		return false;
+
+	sumBayerChannels( fnKernel, pChannels, nPixels, pBayer );
+	return true;
+}
@@ -1,6 +1,7 @@
 #if SH_CAMERA
 
 #include <libraw/libraw.h>
+#include <algorithm>
 #include <chrono>
 
 #include "Util.h"
@@ -19,7 +20,12 @@ void checkErr( const int retVal, std::string strName )
 }
 #endif
 
+// How many streamed frames we hold on to
+const size_t kCapturedImageCount = 8;
+
 SHCamera::SHCamera( std::string strNamePrefix, int nImagesToCapture, int nShutterDuration ) :
+	m_frCapturedImages( kCapturedImageCount ),
+	m_nModeGeneration( 0 ),
 	m_eMode( Mode::Off ),
 	m_strImgCapturePrefix( strNamePrefix ),
 	m_nImageCaptureLimit( nImagesToCapture ),
@@ -29,7 +35,14 @@ SHCamera::SHCamera( std::string strNamePrefix, int nImagesToCapture, int nShutte
 	m_pGPContext( nullptr ),
 	m_pGPCamera( nullptr )
 #endif
-{}
+{
+#if SH_USE_EDSDK
+	m_nEvfStackFrames = 1;
+	m_bEvfSigmaClip = false;
+	m_bResetEvfStack = false;
+	m_upEvfDecoder.reset( new EvfDecoder( [this] ( const cv::Mat& img, const size_t nGeneration ) { postEvfImage( img, nGeneration ); } ) );
+#endif
+}
 
 SHCamera::~SHCamera()
 {
@@ -39,16 +52,9 @@ SHCamera::~SHCamera()
 
 ImageSource::Status SHCamera::GetNextImage( img_t * pImg )
 {
-    {
-		std::lock_guard<std::mutex> lg( m_muCapture );
-		//std::cout << m_liCapturedImages.size() << std::endl;
-		if ( !m_liCapturedImages.empty() )
-		{
-			*pImg = m_liCapturedImages.front();
-			m_liCapturedImages.pop_front();
-			return Status::READY;
-		}
-    }
+	// Anything captured before the last mode switch is thrown out
+	if ( m_frCapturedImages.Pop( pImg, m_nModeGeneration ) )
+		return Status::READY;
 
 	if ( GetMode() != Mode::Off )
 		return Status::WAIT;
@@ -56,6 +62,40 @@ ImageSource::Status SHCamera::GetNextImage( img_t * pImg )
     return Status::DONE;
 }
 
+ImageSource::Status SHCamera::WaitForNextImage( img_t * pImg, const std::chrono::milliseconds tTimeout )
+{
+	{
+		// Sleep until an image is posted or we get switched off
+		std::unique_lock<std::mutex> lk( m_muCapture );
+		m_cvCapture.wait_for( lk, tTimeout, [this] ()
+		{
+			return !m_frCapturedImages.Empty() || GetMode() == Mode::Off;
+		} );
+	}
+
+	return GetNextImage( pImg );
+}
+
+void SHCamera::SetEvfDownscale( const int nDenom )
+{
+#if SH_USE_EDSDK
+	m_upEvfDecoder->SetDownscale( nDenom );
+#endif
+}
+
+void SHCamera::SetEvfStacking( const int nFrames, const bool bSigmaClip )
+{
+#if SH_USE_EDSDK
+	m_nEvfStackFrames = nFrames;
+	m_bEvfSigmaClip = bSigmaClip;
+#endif
+}
+
+size_t SHCamera::GetDroppedImageCount() const
+{
+	return m_frCapturedImages.GetDropCount();
+}
+
 void SHCamera::Initialize()
 {
 	// Make sure we've wrapped up
@@ -215,14 +255,20 @@ void SHCamera::SetMode( Mode mode )
 		}
 
 		// Store new mode (should this be done before commands are posted?)
+		// Frames from before now are stale, which GetNextImage and
+		// postEvfImage can tell from the generation they're stamped with.
+		// The live view stack starts over too (it's flagged first, so
+		// postEvfImage sees it with the first frame of the new mode)
 		m_eMode = mode;
+		m_bResetEvfStack = true;
+		m_nModeGeneration++;
 	}
 
+	// Wake up anyone waiting since we might be off now
 	{
-		// If we're changing modes, clear our list of captured images
 		std::lock_guard<std::mutex> lgCapture( m_muCapture );
-		m_liCapturedImages.clear();
 	}
+	m_cvCapture.notify_all();
 
 	// Start capture thread if necessary
 	if ( bStartThread )
@@ -253,8 +299,8 @@ void SHCamera::threadProc()
 	for ( Mode eCurMode = GetMode(); eCurMode != Mode::Off; eCurMode = GetMode() )
 	{
 #if SH_USE_EDSDK
-		std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
-		auto pCMD = m_CMDQueue.pop();
+		// Sleep until there's a command (switching modes posts one)
+		auto pCMD = m_CMDQueue.pop( std::chrono::milliseconds( 100 ) );
 		if ( pCMD )
 		{
 			if ( pCMD->execute() == false )
@@ -454,6 +500,56 @@ bool SHCamera::handleCapturedImage( EdsDirectoryItemRef inRef )
 	return true;
 }
 
+void SHCamera::postEvfImage( const cv::Mat& img, const size_t nGeneration )
+{
+	// Downloaded before the last mode switch, don't bother
+	if ( nGeneration != m_nModeGeneration )
+		return;
+
+	// Don't stack on frames from the last time we were streaming,
+	// the sky's probably moved since (only we touch the stacker)
+	if ( m_bResetEvfStack.exchange( false ) )
+		m_EvfStacker.Reset();
+
+	// Pick up new stacking settings (this starts the stack over)
+	const size_t nStackFrames = (size_t) std::max( 1, m_nEvfStackFrames.load() );
+	const FrameStacker::Mode eStackMode = m_bEvfSigmaClip ? FrameStacker::Mode::SigmaClip : FrameStacker::Mode::Mean;
+	if ( nStackFrames != m_EvfStacker.GetWindow() || eStackMode != m_EvfStacker.GetMode() )
+		m_EvfStacker.SetWindow( nStackFrames, eStackMode );
+
+	// Post image into the next free slot (if nobody's
+	// keeping up this overwrites the oldest frame).
+	// We're the only thread that pushes
+	img_t& imgPost = m_frCapturedImages.BeginPush();
+	if ( nStackFrames > 1 )
+	{
+		// Add it to the stack, which updates the running sums
+		m_EvfStacker.Push( img );
+#if SH_CUDA
+		m_EvfStacker.GetStacked( m_imgEvfStacked );
+		imgPost.upload( m_imgEvfStacked );
+#else
+		m_EvfStacker.GetStacked( imgPost );
+#endif
+	}
+	else
+	{
+#if SH_CUDA
+		imgPost.upload( img );
+#else
+		img.copyTo( imgPost );
+#endif
+	}
+	m_frCapturedImages.EndPush( nGeneration );
+
+	// Wake up WaitForNextImage (taking the lock
+	// so it can't miss this between check and wait)
+	{
+		std::lock_guard<std::mutex> lg( m_muCapture );
+	}
+	m_cvCapture.notify_one();
+}
+
 bool SHCamera::handleEvfImage()
 {
 	if ( m_pCamModel == nullptr )
@@ -479,16 +575,14 @@ bool SHCamera::handleEvfImage()
 		return false;
 	}
 
-	// Download live view image data.
+	// Download live view image data. It belongs to the
+	// mode we're in now, even if that changes before it's posted
+	const size_t nGeneration = m_nModeGeneration;
 	err = EdsDownloadEvfImage( m_pCamModel->getCameraObject(), imgRef );
 
-	// Convert JPG to img, post
+	// Hand the JPG to the decoder
 	if ( err == EDS_ERR_OK )
 	{
-		// Cache the current mode here
-		SHCamera::Mode appMode = GetMode();
-		size_t nImages( 1 );
-
 		// Get image data/size
 		void * pData( nullptr );
 		EdsUInt64 uDataSize( 0 );
@@ -498,66 +592,12 @@ bool SHCamera::handleEvfImage()
 			err = EdsGetPointer( evfStmRef, &pData );
 			if ( err == EDS_ERR_OK )
 			{
+				// It seems like the camera gives me a JPG, which the
+				// decoder copies and decodes so we can get back to it
 				if ( uDataSize && pData )
-				{
-					// It seems like the camera gives me a JPG
-					// that gets converted into a BGR24 image
-					cv::Mat matJPG( 1, uDataSize, CV_8UC1, pData );
-					cv::Mat matImg = cv::imdecode( matJPG, 1 );
-					if ( matImg.empty() || matImg.type() != CV_8UC3 )
-					{
-						throw std::runtime_error( "Error decoding JPG image!" );
-					}
-
-					// convert to RGB
-					// I actually don't know why I can't do everything
-					// in BGR, but the images kept coming up black
-					cv::cvtColor( matImg, matImg, CV_BGR2RGB );
-
-					// Convert to single channel float
-					cv::Mat imgGrey;
-					cv::cvtColor( matImg, imgGrey, CV_BGR2GRAY );
-					imgGrey.convertTo( matImg, CV_32FC1, 1.f / 0xFF );
-
-					if ( nImages > 1 )
-						m_liImageStack.emplace_back( std::move( matImg ) );
-					else
-						m_liImageStack = { matImg };
-				}
+					m_upEvfDecoder->Post( pData, (size_t) uDataSize, nGeneration );
 			}
 		}
-		
-		// Every nImages, collapse the stack
-		if ( m_liImageStack.size() >= nImages )
-		{
-			// Average the pixels of every image in the stack
-			cv::Mat avgImg( m_liImageStack.front().rows, m_liImageStack.front().cols, m_liImageStack.front().type() );
-			avgImg.setTo( 0 );
-			const float fDiv = 1.f / m_liImageStack.size();
-			for ( cv::Mat& img : m_liImageStack )
-				avgImg += fDiv * img;
-
-
-			// Lock mutex, post image
-			{
-				std::lock_guard<std::mutex> lg( m_muCapture );
-
-				// Pop off oldest 10 from front
-				if ( m_liCapturedImages.size() > 10 )
-					m_liCapturedImages.erase( m_liCapturedImages.begin(), std::next( m_liCapturedImages.begin(), 10 ) );
-#if SH_CUDA
-				img_t imgUpload;
-				imgUpload.upload( avgImg );
-				m_liCapturedImages.push_back( imgUpload );
-#else
-				m_liCapturedImages.push_back( avgImg );
-#endif
-			}
-
-			// Clear stack
-			m_liImageStack.clear();
-		}
-
 
 		if ( evfStmRef )
 			EdsRelease( evfStmRef );
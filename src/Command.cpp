@@ -503,10 +503,24 @@ CmdPtr CommandQueue::pop()
 	return std::move( ret );
 }
 
+CmdPtr CommandQueue::pop( const std::chrono::milliseconds tTimeout )
+{
+	std::unique_lock<std::mutex> lk( m_muCommandMutex );
+	if ( !m_cvCommand.wait_for( lk, tTimeout, [this] () { return !m_liCommands.empty(); } ) )
+		return nullptr;
+
+	auto ret = std::move( m_liCommands.front() );
+	m_liCommands.pop_front();
+	return std::move( ret );
+}
+
 void CommandQueue::push_back( Command * pCMD )
 {
-	std::lock_guard<std::mutex> lg( m_muCommandMutex );
-	m_liCommands.emplace_back( pCMD );
+	{
+		std::lock_guard<std::mutex> lg( m_muCommandMutex );
+		m_liCommands.emplace_back( pCMD );
+	}
+	m_cvCommand.notify_one();
 }
 
 void CommandQueue::SetCloseCommand( Command * pCMD )
@@ -1,17 +1,54 @@
 #include "Engine.h"
+#include "FrameQueue.h"
 
 #include <thread>
 #include <chrono>
+#include <exception>
 
 #if SH_CAMERA && defined(WIN32)
 #include <SDL.h>
 #endif
 
+ImageSource::Status ImageSource::WaitForNextImage( img_t * pImg, const std::chrono::milliseconds tTimeout )
+{
+	Status st = GetNextImage( pImg );
+	if ( st != Status::WAIT )
+		return st;
+
+	std::this_thread::sleep_for( tTimeout );
+	return GetNextImage( pImg );
+}
+
 Engine::Engine( ImageSource::Ptr&& pImgSrc, ImageProcessor::Ptr&& pImgProc ) :
 	m_pImageSource( std::move( pImgSrc ) ),
-	m_pImageProcessor( std::move( pImgProc ) )
+	m_pImageProcessor( std::move( pImgProc ) ),
+	m_nQueueDepth( 0 ),
+	m_eBacklog( Backlog::Block )
 {}
 
+void Engine::SetPipelined( const size_t nQueueDepth, const Backlog eBacklog )
+{
+	m_nQueueDepth = nQueueDepth;
+	m_eBacklog = eBacklog;
+}
+
+// Returns true if the user asked to quit
+static bool pollQuitEvent()
+{
+	bool bQuitFlag( false );
+#if SH_CAMERA && defined(WIN32)
+	SDL_Event e { 0 };
+	while ( SDL_PollEvent( &e ) )
+	{
+		if ( e.type == SDL_KEYUP && e.key.keysym.sym == SDLK_ESCAPE )
+		{
+			bQuitFlag = true;
+		}
+	}
+#endif
+	return bQuitFlag;
+}
+
 void Engine::Run()
 {
 	if ( !( m_pImageSource && m_pImageProcessor ) )
@@ -26,36 +63,99 @@ void Engine::Run()
     m_pImageSource->Initialize();
     m_pImageProcessor->Initialize();
 
-    // Iterate over all images
+	if ( m_nQueueDepth )
+		runPipelined();
+	else
+		runSerial();
+
+#if SH_CAMERA && defined(WIN32)
+    SDL_DestroyWindow( pWindow );
+#endif
+
+    // Finalize source / processor
+	m_pImageProcessor->Finalize();
+    m_pImageSource->Finalize();
+}
+
+void Engine::runSerial()
+{
+    // Iterate over all images, waiting a bit for each
+    // so we can keep an eye out for the quit key
 	bool bQuitFlag( false );
     using ImgStat = ImageSource::Status;
+	const std::chrono::milliseconds tWait( 10 );
 	img_t img;
-    for ( ImgStat st = m_pImageSource->GetNextImage( &img ); st != ImgStat::DONE && !bQuitFlag; m_pImageSource->GetNextImage( &img ) )
+    for ( ImgStat st = m_pImageSource->WaitForNextImage( &img, tWait ); st != ImgStat::DONE && !bQuitFlag; st = m_pImageSource->WaitForNextImage( &img, tWait ) )
     {
         if (st == ImgStat::WAIT)
         {
-#if SH_CAMERA && defined(WIN32)
-            SDL_Event e { 0 };
-			while ( SDL_PollEvent( &e ) )
-			{
-				if ( e.type == SDL_KEYUP && e.key.keysym.sym == SDLK_ESCAPE )
-				{
-					bQuitFlag = true;
-				}
-			}
-#endif
-
-            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			bQuitFlag = pollQuitEvent();
         }
         else if (st == ImgStat::READY){
+			// The processor borrows img; nothing touches
+			// it until HandleImage returns and we ask the
+			// source for the next one
 			m_pImageProcessor->HandleImage( img );
         }
     }
-#if SH_CAMERA && defined(WIN32)
-    SDL_DestroyWindow( pWindow );
-#endif
+}
 
-    // Finalize source / processor
-	m_pImageProcessor->Finalize();
-    m_pImageSource->Finalize();
-}
\ No newline at end of file
+void Engine::runPipelined()
+{
+	using ImgStat = ImageSource::Status;
+	FrameQueue frameQueue( m_nQueueDepth, m_eBacklog == Backlog::Block ? FrameQueue::Policy::Block : FrameQueue::Policy::DropOldest );
+
+	// The acquisition thread copies each frame into the queue, since
+	// the source is free to reuse it once we ask for the next one
+	std::exception_ptr pAcquireError;
+	std::thread thAcquire( [this, &frameQueue, &pAcquireError] ()
+	{
+		try
+		{
+			img_t img;
+			const std::chrono::milliseconds tWait( 10 );
+			for ( ImgStat st = m_pImageSource->WaitForNextImage( &img, tWait ); st != ImgStat::DONE; st = m_pImageSource->WaitForNextImage( &img, tWait ) )
+			{
+				if ( st == ImgStat::WAIT )
+				{
+					if ( frameQueue.IsClosed() )
+						break;
+				}
+				else if ( st == ImgStat::READY && !frameQueue.Push( img ) )
+					break;
+			}
+		}
+		catch ( ... )
+		{
+			pAcquireError = std::current_exception();
+		}
+
+		// Let the processor drain what's left
+		frameQueue.Close();
+	} );
+
+	// Process frames here as they come, polling for quit while we wait
+	try
+	{
+		img_t img;
+		for ( ImgStat st = frameQueue.Pop( &img, std::chrono::milliseconds( 10 ) ); st != ImgStat::DONE; st = frameQueue.Pop( &img, std::chrono::milliseconds( 10 ) ) )
+		{
+			if ( pollQuitEvent() )
+				break;
+			if ( st == ImgStat::READY )
+				m_pImageProcessor->HandleImage( img );
+		}
+	}
+	catch ( ... )
+	{
+		frameQueue.Close();
+		thAcquire.join();
+		throw;
+	}
+
+	frameQueue.Close();
+	thAcquire.join();
+
+	if ( pAcquireError )
+		std::rethrow_exception( pAcquireError );
+}
@@ -0,0 +1,103 @@
+#include "EvfDecoder.h"
+
+#include <stdexcept>
+#include <string>
+
+EvfDecoder::EvfDecoder( FrameHandler fnHandler ) :
+	m_fnHandler( std::move( fnHandler ) ),
+	m_nDownscale( 1 ),
+	m_nPendingTag( 0 ),
+	m_bPending( false ),
+	m_bQuit( false ),
+	m_nDropped( 0 ),
+	m_nDecodingTag( 0 ),
+	m_thDecode( &EvfDecoder::threadProc, this )
+{}
+
+EvfDecoder::~EvfDecoder()
+{
+	{
+		std::lock_guard<std::mutex> lg( m_muJpeg );
+		m_bQuit = true;
+	}
+	m_cvJpeg.notify_one();
+	m_thDecode.join();
+}
+
+void EvfDecoder::Post( const void * pData, const size_t uNumBytes, const size_t nTag )
+{
+	{
+		// assign reuses the buffer once it's big enough
+		std::lock_guard<std::mutex> lg( m_muJpeg );
+		if ( m_bPending )
+			m_nDropped++;
+		m_vPending.assign( (const uint8_t *) pData, (const uint8_t *) pData + uNumBytes );
+		m_nPendingTag = nTag;
+		m_bPending = true;
+	}
+	m_cvJpeg.notify_one();
+}
+
+void EvfDecoder::SetDownscale( const int nDenom )
+{
+	if ( nDenom != 1 && nDenom != 2 && nDenom != 4 )
+		throw std::runtime_error( "Error: Live view can't be downscaled by " + std::to_string( nDenom ) );
+	m_nDownscale = nDenom;
+}
+
+size_t EvfDecoder::GetDroppedCount() const
+{
+	std::lock_guard<std::mutex> lg( m_muJpeg );
+	return m_nDropped;
+}
+
+void EvfDecoder::threadProc()
+{
+	for ( ;; )
+	{
+		// Take the latest JPEG
+		{
+			std::unique_lock<std::mutex> lk( m_muJpeg );
+			m_cvJpeg.wait( lk, [this] () { return m_bPending || m_bQuit; } );
+			if ( m_bQuit )
+				return;
+
+			std::swap( m_vPending, m_vDecoding );
+			m_nDecodingTag = m_nPendingTag;
+			m_bPending = false;
+		}
+
+		// The reduced modes have libjpeg scale in the DCT
+		const int nDownscale = m_nDownscale;
+		const int nFlags = nDownscale == 4 ? cv::IMREAD_REDUCED_GRAYSCALE_4 :
+			nDownscale == 2 ? cv::IMREAD_REDUCED_GRAYSCALE_2 : cv::IMREAD_GRAYSCALE;
+
+		// Decode into our own mat (reusing its storage),
+		// then make the normalized float frame. A bad JPEG
+		// or a handler that throws costs us this frame, but
+		// mustn't take the thread (and the program) down
+		bool bDecoded = false;
+		try
+		{
+			const cv::Mat matJPG( 1, (int) m_vDecoding.size(), CV_8UC1, m_vDecoding.data() );
+			cv::imdecode( matJPG, nFlags, &m_imgGray );
+			if ( !m_imgGray.empty() && m_imgGray.type() == CV_8UC1 )
+			{
+				cv::Mat imgFrame = m_FramePool.Get( m_imgGray.size(), CV_32FC1 );
+				m_imgGray.convertTo( imgFrame, CV_32FC1, 1.f / 0xFF );
+				m_fnHandler( imgFrame, m_nDecodingTag );
+				bDecoded = true;
+			}
+		}
+		catch ( ... )
+		{
+			// Counted as dropped below
+		}
+
+		if ( !bDecoded )
+		{
+			std::lock_guard<std::mutex> lg( m_muJpeg );
+			m_nDropped++;
+		}
+	}
+}
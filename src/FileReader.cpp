@@ -1,21 +1,25 @@
 #include "FileReader.h"
+#include "Bayer.h"
 #include "Util.h"
+#include "Warp.h"
 
 #include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #if SH_CAMERA
 #include <libraw/libraw.h>
 #endif // SH_CAMERA
 
-ImageSource::Status FileReader::GetNextImage( img_t * pImg )
+// Loads a png or cr2 file into a normalized float image from framePool,
+// using imgGray as scratch for colour images. If bBin2x2 is set the
+// image is half size, each pixel the average of 2x2. Throws if it can't
+static img_t loadImage( const std::string& strFileName, const bool bBin2x2, FramePool& framePool, img_t& imgGray )
 {
-	if ( m_liFileNames.empty() )
-		return ImageSource::Status::DONE;
-
-    // Get the first file name and pop it off
-    std::string strFileName = std::move( m_liFileNames.front() );
-	m_liFileNames.pop_front();
-
     // Load the image (handle png and raw separately)
     size_t ixDot = strFileName.find_last_of( "." );
     if ( ixDot != std::string::npos && ixDot < strFileName.size() - 1 )
@@ -32,111 +36,381 @@ ImageSource::Status FileReader::GetNextImage( img_t * pImg )
 #endif
 			if ( !imgPng.empty() )
 			{
-				img_t imgRet;
+				// The float image comes from the pool, and the
+				// gray scratch is only reallocated if the size changes
+				img_t imgRet = framePool.Get( imgPng.size(), CV_32FC1 );
 				const double dDivFactor = 1. / ( 1 << ( 8 * imgPng.elemSize() / imgPng.channels() ) );
 				if ( imgPng.channels() > 1 )
 				{
-					img_t imgPngGray;
-					::cvtColor( imgPng, imgPngGray, CV_RGB2GRAY );
-					imgPngGray.convertTo( imgRet, CV_32FC1, dDivFactor );
+					::cvtColor( imgPng, imgGray, CV_RGB2GRAY );
+					imgGray.convertTo( imgRet, CV_32FC1, dDivFactor );
 				}
 				else
 				{
 					imgPng.convertTo( imgRet, CV_32FC1, dDivFactor );
 				}
 
-				*pImg = imgRet;
-				return Status::READY;
+				if ( bBin2x2 )
+				{
+					img_t imgBinned = framePool.Get( cv::Size( imgRet.cols / 2, imgRet.rows / 2 ), CV_32FC1 );
+					::resize( imgRet, imgBinned, imgBinned.size(), 0, 0, cv::INTER_AREA );
+					imgRet = imgBinned;
+				}
+
+				return imgRet;
 			}
 		}
 #if SH_CAMERA
 		else if ( strExt == "cr2" )
 		{
-			*pImg = Raw2Img( strFileName );
-			return Status::READY;
+			return Raw2Img( strFileName, bBin2x2 );
 		}
 #endif
     }
 
     // We should have handled it
     throw std::runtime_error( "Error: FileReader unable to load image!" );
-	return Status::DONE;
 }
 
-void FileReader_WithDrift::IncDriftVel( int nDriftX, int nDriftY )
+// Worker threads that decode the files queued up by FileReader. Files
+// are queued in order and each one's result waits in its slot until
+// it's popped, so however the workers finish the order is kept
+class FilePrefetcher
+{
+public:
+	FilePrefetcher( FramePool& framePool, const std::atomic<bool>& bBin2x2, const size_t nDepth, const size_t nWorkers );
+	~FilePrefetcher();
+
+	// Takes files off the front of liFileNames until nDepth are queued
+	void Queue( std::list<std::string>& liFileNames );
+
+	// Waits for the oldest queued file and returns its image (or throws
+	// whatever decoding it threw). Returns false if nothing is queued
+	bool Pop( img_t * pImg );
+
+	// Stops the workers and puts the files that haven't
+	// been popped back on the front of liFileNames
+	void Stop( std::list<std::string>& liFileNames );
+
+private:
+	struct Job
+	{
+		std::string strFileName;
+		img_t img;
+		std::exception_ptr pError;
+		bool bStarted;
+		bool bDone;
+	};
+
+	void workerProc();
+	void joinWorkers();
+
+	FramePool& m_FramePool;
+	const std::atomic<bool>& m_bBin2x2;
+	size_t m_nDepth;
+
+	// Oldest first. Workers keep a pointer to the job they're
+	// on, which is fine since a deque only moves the elements
+	// we erase, and we only erase finished ones
+	std::deque<Job> m_dqJobs;
+	bool m_bQuit;
+
+	std::mutex m_muJobs;
+	std::condition_variable m_cvQueued;	// Signalled on new jobs / quit
+	std::condition_variable m_cvDone;	// Signalled on finished jobs
+	std::vector<std::thread> m_vWorkers;
+};
+
+FilePrefetcher::FilePrefetcher( FramePool& framePool, const std::atomic<bool>& bBin2x2, const size_t nDepth, const size_t nWorkers ) :
+	m_FramePool( framePool ),
+	m_bBin2x2( bBin2x2 ),
+	m_nDepth( nDepth ),
+	m_bQuit( false )
+{
+	for ( size_t i = 0; i < std::max<size_t>( nWorkers, 1 ); i++ )
+		m_vWorkers.emplace_back( &FilePrefetcher::workerProc, this );
+}
+
+FilePrefetcher::~FilePrefetcher()
+{
+	joinWorkers();
+}
+
+void FilePrefetcher::joinWorkers()
+{
+	{
+		std::lock_guard<std::mutex> lg( m_muJobs );
+		m_bQuit = true;
+	}
+	m_cvQueued.notify_all();
+
+	for ( std::thread& th : m_vWorkers )
+		th.join();
+	m_vWorkers.clear();
+}
+
+void FilePrefetcher::Stop( std::list<std::string>& liFileNames )
+{
+	// Once the workers are gone nobody's using the jobs
+	joinWorkers();
+	for ( auto it = m_dqJobs.rbegin(); it != m_dqJobs.rend(); ++it )
+		liFileNames.push_front( std::move( it->strFileName ) );
+	m_dqJobs.clear();
+}
+
+void FilePrefetcher::Queue( std::list<std::string>& liFileNames )
+{
+	{
+		std::lock_guard<std::mutex> lg( m_muJobs );
+		if ( liFileNames.empty() || m_dqJobs.size() >= m_nDepth )
+			return;
+
+		while ( !liFileNames.empty() && m_dqJobs.size() < m_nDepth )
+		{
+			m_dqJobs.push_back( { std::move( liFileNames.front() ), img_t(), nullptr, false, false } );
+			liFileNames.pop_front();
+		}
+	}
+	m_cvQueued.notify_all();
+}
+
+bool FilePrefetcher::Pop( img_t * pImg )
+{
+	Job job;
+	{
+		std::unique_lock<std::mutex> lk( m_muJobs );
+		if ( m_dqJobs.empty() )
+			return false;
+
+		m_cvDone.wait( lk, [this] () { return m_dqJobs.front().bDone; } );
+		job = std::move( m_dqJobs.front() );
+		m_dqJobs.pop_front();
+	}
+
+	if ( job.pError )
+		std::rethrow_exception( job.pError );
+
+	*pImg = job.img;
+	return true;
+}
+
+void FilePrefetcher::workerProc()
+{
+	// Each worker has its own scratch
+	img_t imgGray;
+
+	std::unique_lock<std::mutex> lk( m_muJobs );
+	for ( ;; )
+	{
+		// Take the oldest job nobody's started, unless we're quitting
+		// (then whatever's left goes back to the reader undecoded)
+		Job * pJob = nullptr;
+		m_cvQueued.wait( lk, [this, &pJob] ()
+		{
+			if ( m_bQuit )
+				return true;
+			for ( Job& job : m_dqJobs )
+			{
+				if ( !job.bStarted )
+				{
+					pJob = &job;
+					return true;
+				}
+			}
+			return false;
+		} );
+		if ( m_bQuit )
+			return;
+
+		pJob->bStarted = true;
+		const std::string strFileName = pJob->strFileName;
+		lk.unlock();
+
+		img_t img;
+		std::exception_ptr pError;
+		try
+		{
+			img = loadImage( strFileName, m_bBin2x2, m_FramePool, imgGray );
+		}
+		catch ( ... )
+		{
+			pError = std::current_exception();
+		}
+
+		lk.lock();
+		pJob->img = img;
+		pJob->pError = pError;
+		pJob->bDone = true;
+		m_cvDone.notify_all();
+	}
+}
+
+FileReader::FileReader( std::list<std::string> liFileNames ) :
+	m_liFileNames( std::move( liFileNames ) ),
+	m_bBin2x2( false )
+{}
+
+void FileReader::SetBin2x2( const bool bBin2x2 )
+{
+	m_bBin2x2 = bBin2x2;
+}
+
+FileReader::~FileReader()
+{
+	// The workers load into our pool, so they go first
+	m_upPrefetcher.reset();
+}
+
+void FileReader::SetPrefetch( const size_t nDepth, const size_t nWorkers )
+{
+	// Anything already queued goes back on the front of the list
+	if ( m_upPrefetcher )
+	{
+		m_upPrefetcher->Stop( m_liFileNames );
+		m_upPrefetcher.reset();
+	}
+
+	if ( nDepth > 0 )
+	{
+		// Each queued file holds a frame, plus the ones being processed
+		m_FramePool.SetMaxBuffers( nDepth + 4 );
+		m_upPrefetcher.reset( new FilePrefetcher( m_FramePool, m_bBin2x2, nDepth, nWorkers ) );
+	}
+}
+
+ImageSource::Status FileReader::GetNextImage( img_t * pImg )
 {
-    m_nDriftVelX += nDriftX;
-    m_nDriftVelY += nDriftY;
+	if ( m_upPrefetcher )
+	{
+		// Keep the queue full, so the workers have the next
+		// few files decoding while the caller processes this one
+		m_upPrefetcher->Queue( m_liFileNames );
+		if ( !m_upPrefetcher->Pop( pImg ) )
+			return Status::DONE;
+		m_upPrefetcher->Queue( m_liFileNames );
+		return Status::READY;
+	}
+
+	if ( m_liFileNames.empty() )
+		return ImageSource::Status::DONE;
+
+    // Get the first file name and pop it off
+    std::string strFileName = std::move( m_liFileNames.front() );
+	m_liFileNames.pop_front();
+
+	*pImg = loadImage( strFileName, m_bBin2x2, m_FramePool, m_imgGray );
+	return Status::READY;
 }
 
-void FileReader_WithDrift::SetDriftVel( int nDriftX, int nDriftY )
+void FileReader_WithDrift::IncDriftVel( float fDriftX, float fDriftY )
 {
-    m_nDriftVelX = nDriftX;
-    m_nDriftVelY = nDriftY;
+    std::lock_guard<std::mutex> lg( m_muDrift );
+    m_fDriftVelX += fDriftX;
+    m_fDriftVelY += fDriftY;
 }
 
-void FileReader_WithDrift::SetOffset( int nOfsX, int nOfsY )
+void FileReader_WithDrift::SetDriftVel( float fDriftX, float fDriftY )
 {
-    m_nOfsX = nOfsX;
-    m_nOfsY = nOfsY;
+    std::lock_guard<std::mutex> lg( m_muDrift );
+    m_fDriftVelX = fDriftX;
+    m_fDriftVelY = fDriftY;
 }
 
-void FileReader_WithDrift::GetDriftVel( int * pnDriftX, int * pnDriftY ) const
+void FileReader_WithDrift::SetOffset( float fOfsX, float fOfsY )
 {
-    if ( pnDriftX )
-        *pnDriftX = m_nDriftVelX;
-    if ( pnDriftY )
-        *pnDriftY = m_nDriftVelY;
+    std::lock_guard<std::mutex> lg( m_muDrift );
+    m_fOfsX = fOfsX;
+    m_fOfsY = fOfsY;
 }
 
-void FileReader_WithDrift::GetOffset(int * pnOfsX, int * pnOfsY) const{
-    if (pnOfsX)
-        *pnOfsX = m_nOfsX;
-    if (pnOfsY)
-        *pnOfsY = m_nOfsY;
+void FileReader_WithDrift::GetDriftVel( float * pfDriftX, float * pfDriftY ) const
+{
+    std::lock_guard<std::mutex> lg( m_muDrift );
+    if ( pfDriftX )
+        *pfDriftX = m_fDriftVelX;
+    if ( pfDriftY )
+        *pfDriftY = m_fDriftVelY;
+}
+
+void FileReader_WithDrift::GetOffset( float * pfOfsX, float * pfOfsY ) const
+{
+    std::lock_guard<std::mutex> lg( m_muDrift );
+    if ( pfOfsX )
+        *pfOfsX = m_fOfsX;
+    if ( pfOfsY )
+        *pfOfsY = m_fOfsY;
+}
+
+void FileReader_WithDrift::SetRotation( float fRotation )
+{
+    std::lock_guard<std::mutex> lg( m_muDrift );
+    m_fRotation = fRotation;
+}
+
+void FileReader_WithDrift::SetRotationVel( float fRotationVel )
+{
+    std::lock_guard<std::mutex> lg( m_muDrift );
+    m_fRotationVel = fRotationVel;
+}
+
+float FileReader_WithDrift::GetRotation() const
+{
+    std::lock_guard<std::mutex> lg( m_muDrift );
+    return m_fRotation;
+}
+
+void FileReader_WithDrift::SetNoise( const NoiseModel& noise, uint64_t nSeed )
+{
+    std::lock_guard<std::mutex> lg( m_muDrift );
+    m_Noise = noise;
+    m_nNoiseSeed = nSeed;
 }
 
 ImageSource::Status FileReader_WithDrift::GetNextImage( img_t * pImg )
 {
     // Get next image
 	img_t img;
-	if ( FileReader::GetNextImage( &img ) == Status::DONE )
-		return Status::DONE;
-
-    // Update offset value
-    m_nOfsX += m_nDriftVelX;
-    m_nOfsY += m_nDriftVelY;
+	const Status st = FileReader::GetNextImage( &img );
+	if ( st != Status::READY )
+		return st;
+
+    // Update offset and rotation, then work with a snapshot
+    // of everything (it can be changed from another thread)
+    float fOfsX, fOfsY, fRotation;
+    NoiseModel noise;
+    uint64_t nNoiseSeed;
+    {
+        std::lock_guard<std::mutex> lg( m_muDrift );
+        fOfsX = m_fOfsX += m_fDriftVelX;
+        fOfsY = m_fOfsY += m_fDriftVelY;
+        fRotation = m_fRotation += m_fRotationVel;
+        noise = m_Noise;
+        nNoiseSeed = SplitMix64( m_nNoiseSeed ).Next() + m_nFrame++;
+    }
 
-    // Return if no offset
-	if ( !( m_nOfsX || m_nOfsY ) )
+    // Return if there's nothing to do
+	if ( !( fOfsX || fOfsY || fRotation ) && noise.IsNone() )
 	{
 		*pImg = img;
 		return Status::READY;
 	}
-    
-    // std::cout << m_nOfsX << ", " << m_nOfsY << std::endl;
-
-    // Do the translation by moving a sub-image
-    // at an offset into a new mat
-    cv::Rect rcSrc, rcDst;
-
-    // X position, left is 0
-    rcSrc.x = m_nOfsX < 0 ? -m_nOfsX : 0;
-    rcSrc.width = img.cols - abs( m_nOfsX );
-    rcDst.x = -m_nOfsX - rcSrc.x;
-    rcDst.width = rcSrc.width;
-
-    // Y position, top is 0 (so flip)
-    rcSrc.y = m_nOfsY > 0 ? m_nOfsY : 0;
-    rcSrc.height = img.cols - abs( m_nOfsY );
-    rcDst.y = rcSrc.y - m_nOfsY;
-    rcDst.height = rcSrc.height;
-
-    // Copy sub image src into zeroed out dst
-    img_t ret( cv::Mat::zeros( img.size(), img.type() ) );
-    img_t subImg = img( rcSrc );
-    subImg.copyTo( ret( rcDst ) );
-	
+
+    // Warp into a pooled image, off image pixels are 0. Y is up
+    // for the offset, but down in the image, so it's flipped
+    double adInvMap[6];
+    GetShiftRotateMap( img.size(), fOfsX, -fOfsY, fRotation, adInvMap );
+#if SH_CUDA
+    img.download( m_imgHost );
+    WarpAffineBilinear( m_imgHost, adInvMap, 0.f, m_imgHost.size(), m_imgWarped );
+    AddNoise( m_imgWarped, noise, nNoiseSeed );
+    img_t ret = m_FramePool.Get( img.size(), CV_32FC1 );
+    ret.upload( m_imgWarped );
+#else
+    img_t ret = m_FramePool.Get( img.size(), CV_32FC1 );
+    WarpAffineBilinear( img, adInvMap, 0.f, img.size(), ret );
+    AddNoise( ret, noise, nNoiseSeed );
+#endif
+
 	*pImg = ret;
     return Status::READY;
 }
@@ -144,98 +418,140 @@ ImageSource::Status FileReader_WithDrift::GetNextImage( img_t * pImg )
 #ifndef SH_CUDA
 img_t GetBayerData( int width, int height, uint16_t * pData )
 {
-    // Compute area
-	int area = width * height;
-
-	// Create a buffer of ushorts containing the pixel values of the
+	// Create a mat of ushorts containing the pixel values of the
 	// "BG Bayered" image (even rows are RGRGRG..., odd are GBGBGB...)'
-	std::vector<uint16_t> vBayerDataBuffer( area );
+	img_t imgBayer( height, width, CV_16UC1 );
 
-	// Pull the data out of the image
-#pragma omp parallel for
-	for ( int idx = 0; idx < area; idx++ )
-	{
-		// Get the color data - LibRaw gives me 4 shorts, and
-		// only one is nonzero (the bayer component I want at idx)
-		// To avoid a branch I'll just take them all
-		vBayerDataBuffer[idx] += pData[4 * idx + 0];
-		vBayerDataBuffer[idx] += pData[4 * idx + 1];
-		vBayerDataBuffer[idx] += pData[4 * idx + 2];
-		vBayerDataBuffer[idx] += pData[4 * idx + 3];
-
-		// To say this isn't a fudge factor would be a lie - I think the bit
-		// depth of my camera is 14 and I want 16, but I really don't know
-		vBayerDataBuffer[idx] <<= 2;
-
-		// Can I convert to float here? I'm not sure if cvtColor can handle it
-		// but I don't see why not, and I can debayer the image myself
-		//float fVal = vBayerDataBuffer[idx] / float( 1 << 14 );
-
-		// I wonder if I can threshold here without a branch as well
-		// If I have a 14 bit range, cutting off the last 11 bits would
-		// be equivalent to thresholding a float at 0.125f
-		//const uint16_t trunc = vBayerDataBuffer[idx] & 0xC000;
-		//const uint16_t rem = vBayerDataBuffer[idx] & 0x07ff;
-	}
+	// Pull the data out of the image - LibRaw gives me 4 shorts, and
+	// only one is nonzero (the bayer component I want at each pixel)
+	// To avoid a branch SumBayerChannels just adds them all up
+	//
+	// To say the 2 bit shift it does isn't a fudge factor would be a lie - I think
+	// the bit depth of my camera is 14 and I want 16, but I really don't know
+	SumBayerChannels( pData, (size_t) width * height, imgBayer.ptr<uint16_t>() );
 
-    // Construct a mat from the data and return it
-	return cv::Mat( vBayerDataBuffer, CV_16UC1 ).reshape( 1, height );
+	return imgBayer;
 }
 #endif
 
 #if SH_CAMERA
-// Convert some LibRaw object to a image type
-img_t Raw2Img_impl( LibRaw& lrProc, bool bRecycle = true )
+// The bit depth of the camera's raw values, from the largest one it can give
+static int getRawBitDepth( LibRaw& lrProc )
 {
-    // Get image dimensions
-    int width = lrProc.imgdata.sizes.iwidth;
-    int height = lrProc.imgdata.sizes.iheight;
-
-	// Get the bayered data
-	img_t imgBayer = GetBayerData( width, height, (uint16_t *) lrProc.imgdata.image );
-
-	// Get rid of libraw image if requested
-	if ( bRecycle )
-		lrProc.recycle();
+	// If LibRaw doesn't know, I think the bit depth of my camera is 14
+	const unsigned nMaximum = lrProc.imgdata.color.maximum;
+	if ( nMaximum == 0 )
+		return 14;
+
+	int nBits = 8;
+	while ( nBits < 16 && ( 1u << nBits ) <= nMaximum )
+		nBits++;
+	return nBits;
+}
 
+#if SH_CUDA
+// Debayer to gray, normalize and threshold on the GPU, one stage at a time
+static img_t debayerToGray( const img_t& imgBayer, const double dScale, const double dThresh )
+{
 	// Debayer the image to 16-bit gray
 	img_t imgDeBayerGrayU16;
 	::cvtColor( imgBayer, imgDeBayerGrayU16, CV_BayerBG2GRAY );
 
-    // Make normalized float
+	// Make normalized float
 	img_t imgDeBayerGrayF32;
-    const double dDivFactor= 1. / ( 1 << ( 8 * imgDeBayerGrayU16.elemSize() ) );
-	imgDeBayerGrayU16.convertTo( imgDeBayerGrayF32, CV_32FC1, dDivFactor );
+	imgDeBayerGrayU16.convertTo( imgDeBayerGrayF32, CV_32FC1, dScale );
 
 	// Threshold (in place?)
-	const double dThresh = .15;
 	::threshold( imgDeBayerGrayF32, imgDeBayerGrayF32, dThresh, 0, CV_THRESH_TOZERO );
 
-	//displayImage( "Test CR2", imgDeBayerGrayF32 );
+	return imgDeBayerGrayF32;
+}
+#endif
+
+// Convert some unpacked LibRaw object to a normalized, thresholded gray float image
+img_t Raw2Img_impl( LibRaw& lrProc, const bool bBin2x2, bool bRecycle = true )
+{
+	const libraw_image_sizes_t& sizes = lrProc.imgdata.sizes;
+	const double dThresh = .15;
+
+	// Most raws (CR2s included) are a single bayer plane, which we
+	// can use right where it is by cropping it to the visible area
+	// Either way full scale comes from the camera's bit depth
+	cv::Mat imgRaw;
+	img_t imgBayer;
+	const int nBitDepth = getRawBitDepth( lrProc );
+	double dScale = 1. / ( 1 << nBitDepth );
+	if ( const uint16_t * pRaw = lrProc.imgdata.rawdata.raw_image )
+	{
+		const uint16_t * pVisible = pRaw + sizes.top_margin * ( sizes.raw_pitch / sizeof( uint16_t ) ) + sizes.left_margin;
+		imgRaw = cv::Mat( sizes.height, sizes.width, CV_16UC1, (void *) pVisible, sizes.raw_pitch );
+	}
+	else
+	{
+		// Otherwise let LibRaw sort it out, which gives us 4 shorts
+		// per pixel. GetBayerData shifts them up 2 bits, so scale
+		// that back out (anything deeper than 14 bits wraps there)
+		if ( lrProc.raw2image() != LIBRAW_SUCCESS )
+			throw std::runtime_error( "Error: LibRaw unable to make raw image!" );
+		imgBayer = GetBayerData( sizes.iwidth, sizes.iheight, (uint16_t *) lrProc.imgdata.image );
+		dScale /= 4;
+	}
+
+	img_t imgRet;
+#if SH_CUDA
+	if ( bBin2x2 )
+	{
+		// Bin on the host, so there's a quarter as much to upload
+		if ( imgRaw.empty() )
+			imgBayer.download( imgRaw );
+		cv::Mat imgBinned;
+		BayerBin2x2( imgRaw, (float) dScale, (float) dThresh, imgBinned );
+		imgRet.upload( imgBinned );
+	}
+	else
+	{
+		if ( imgBayer.empty() )
+			imgBayer.upload( imgRaw );
+		imgRet = debayerToGray( imgBayer, dScale, dThresh );
+	}
+#else
+	if ( imgRaw.empty() )
+		imgRaw = imgBayer;
+
+	// Debayer (or bin), normalize and threshold in one pass
+	if ( bBin2x2 )
+		BayerBin2x2( imgRaw, (float) dScale, (float) dThresh, imgRet );
+	else
+		BayerToGray( imgRaw, (float) dScale, (float) dThresh, imgRet );
+#endif
+
+	// Get rid of libraw image if requested (we're done with it)
+	if ( bRecycle )
+		lrProc.recycle();
+
+	//displayImage( "Test CR2", imgRet );
 
 	// Return float image
-    return imgDeBayerGrayF32;
+	return imgRet;
 }
 
-img_t Raw2Img( void * pData, size_t uNumBytes )
+img_t Raw2Img( void * pData, size_t uNumBytes, const bool bBin2x2 )
 {
     // Open the CR2 file with LibRaw, unpack, and create image
     LibRaw lrProc;
-    assert( LIBRAW_SUCCESS == lrProc.open_buffer( pData, uNumBytes ) );
-    assert( LIBRAW_SUCCESS == lrProc.unpack() );
-    assert( LIBRAW_SUCCESS == lrProc.raw2image() );
+    if ( lrProc.open_buffer( pData, uNumBytes ) != LIBRAW_SUCCESS || lrProc.unpack() != LIBRAW_SUCCESS )
+        throw std::runtime_error( "Error: LibRaw unable to unpack image!" );
 
-    return Raw2Img_impl( lrProc );
+    return Raw2Img_impl( lrProc, bBin2x2 );
 }
 
-img_t Raw2Img( std::string strFileName )
+img_t Raw2Img( std::string strFileName, const bool bBin2x2 )
 {
     // Open the CR2 file with LibRaw, unpack, and create image
     LibRaw lrProc;
-    assert( LIBRAW_SUCCESS == lrProc.open_file( strFileName.c_str() ) );
-    assert( LIBRAW_SUCCESS == lrProc.unpack() );
-    assert( LIBRAW_SUCCESS == lrProc.raw2image() );
+    if ( lrProc.open_file( strFileName.c_str() ) != LIBRAW_SUCCESS || lrProc.unpack() != LIBRAW_SUCCESS )
+        throw std::runtime_error( "Error: LibRaw unable to unpack " + strFileName );
 
-    return Raw2Img_impl( lrProc );
+    return Raw2Img_impl( lrProc, bBin2x2 );
 }
 #endif
@@ -0,0 +1,315 @@
+#include "FrameArchive.h"
+
+#include <stdexcept>
+#include <string.h>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// What's at the start of the file
+struct FrameArchiveHeader
+{
+	char acMagic[8];
+	uint32_t nVersion;
+	uint32_t nFrames;
+	uint64_t nIndexOffset;
+};
+
+static const char kMagic[8] = { 'S', 'H', 'F', 'R', 'A', 'M', 'E', 'S' };
+static const uint32_t kVersion = 1;
+
+// Frames start on this boundary
+static const uint64_t kFrameAlignment = 64;
+
+// 16 bit frames are scaled like FileReader scales 16 bit pngs
+static const double k16BitScale = 1 << 16;
+
+// Writer
+////////////////////////////////////////////////////
+
+FrameArchiveWriter::FrameArchiveWriter( const std::string& strFileName, const bool b16Bit ) :
+	m_fsOut( strFileName, std::ios::binary | std::ios::trunc ),
+	m_b16Bit( b16Bit ),
+	m_nOffset( 0 )
+{
+	if ( !m_fsOut )
+		throw std::runtime_error( "Error: Unable to create frame archive " + strFileName );
+
+	// The real header goes in once we know where the index is
+	FrameArchiveHeader header = {};
+	m_fsOut.write( (const char *) &header, sizeof( header ) );
+	m_nOffset = sizeof( header );
+}
+
+FrameArchiveWriter::~FrameArchiveWriter()
+{
+	try
+	{
+		Finalize();
+	}
+	catch ( ... )
+	{
+	}
+}
+
+bool FrameArchiveWriter::HandleImage( const img_t& img )
+{
+	if ( img.empty() )
+		return true;
+
+	// Get a host image to write
+#if SH_CUDA
+	img.download( m_imgDownload );
+	Append( m_imgDownload );
+#else
+	Append( img );
+#endif
+
+	return true;
+}
+
+void FrameArchiveWriter::Append( const cv::Mat& imgHost )
+{
+	if ( !m_fsOut.is_open() )
+		throw std::runtime_error( "Error: Frame archive has already been finalized!" );
+
+	if ( imgHost.empty() )
+		return;
+
+	// Write floats, or convert to 16 bit
+	cv::Mat imgFrame = imgHost;
+	if ( imgFrame.type() != CV_32FC1 )
+		throw std::runtime_error( "Error: Frame archives only take single channel float images!" );
+	if ( m_b16Bit )
+	{
+		imgFrame.convertTo( m_imgFrame, CV_16UC1, k16BitScale );
+		imgFrame = m_imgFrame;
+	}
+
+	// Pad up to the next boundary
+	static const char acZeros[kFrameAlignment] = {};
+	const uint64_t nPad = ( kFrameAlignment - m_nOffset % kFrameAlignment ) % kFrameAlignment;
+	m_fsOut.write( acZeros, nPad );
+	m_nOffset += nPad;
+
+	FrameArchiveEntry entry = {};
+	entry.nOffset = m_nOffset;
+	entry.nRows = imgFrame.rows;
+	entry.nCols = imgFrame.cols;
+	entry.nType = imgFrame.type();
+	m_vIndex.push_back( entry );
+
+	// Rows are written without their padding, if any
+	const size_t nRowBytes = imgFrame.cols * imgFrame.elemSize();
+	for ( int y = 0; y < imgFrame.rows; y++ )
+		m_fsOut.write( (const char *) imgFrame.ptr( y ), nRowBytes );
+	m_nOffset += nRowBytes * imgFrame.rows;
+
+	if ( !m_fsOut )
+		throw std::runtime_error( "Error: Failed writing to frame archive!" );
+}
+
+void FrameArchiveWriter::Finalize()
+{
+	if ( !m_fsOut.is_open() )
+		return;
+
+	// Index goes after the last frame, then fill in the header
+	const uint64_t nPad = ( sizeof( uint64_t ) - m_nOffset % sizeof( uint64_t ) ) % sizeof( uint64_t );
+	const char acZeros[sizeof( uint64_t )] = {};
+	m_fsOut.write( acZeros, nPad );
+
+	FrameArchiveHeader header = {};
+	memcpy( header.acMagic, kMagic, sizeof( kMagic ) );
+	header.nVersion = kVersion;
+	header.nFrames = (uint32_t) m_vIndex.size();
+	header.nIndexOffset = m_nOffset + nPad;
+
+	if ( !m_vIndex.empty() )
+		m_fsOut.write( (const char *) m_vIndex.data(), m_vIndex.size() * sizeof( FrameArchiveEntry ) );
+	m_fsOut.seekp( 0 );
+	m_fsOut.write( (const char *) &header, sizeof( header ) );
+
+	const bool bOK = !m_fsOut.fail();
+	m_fsOut.close();
+	if ( !bOK )
+		throw std::runtime_error( "Error: Failed writing frame archive index!" );
+}
+
+// Reader
+////////////////////////////////////////////////////
+
+FrameArchiveReader::FrameArchiveReader( const std::string& strFileName, const Access eAccess ) :
+	m_pMapped( nullptr ),
+	m_nMappedSize( 0 ),
+#ifdef WIN32
+	m_hFile( INVALID_HANDLE_VALUE ),
+	m_hMapping( nullptr ),
+#endif
+	m_pIndex( nullptr ),
+	m_nFrames( 0 ),
+	m_nNextFrame( 0 )
+{
+	// Map the whole file copy on write
+#ifdef WIN32
+	const DWORD dwAccessHint = eAccess == Access::Sequential ? FILE_FLAG_SEQUENTIAL_SCAN : FILE_FLAG_RANDOM_ACCESS;
+	m_hFile = CreateFileA( strFileName.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, dwAccessHint, nullptr );
+	if ( m_hFile == INVALID_HANDLE_VALUE )
+		throw std::runtime_error( "Error: Unable to open frame archive " + strFileName );
+
+	LARGE_INTEGER liSize;
+	if ( GetFileSizeEx( m_hFile, &liSize ) && liSize.QuadPart > 0 )
+	{
+		m_nMappedSize = (size_t) liSize.QuadPart;
+		m_hMapping = CreateFileMappingA( m_hFile, nullptr, PAGE_WRITECOPY, 0, 0, nullptr );
+		if ( m_hMapping )
+			m_pMapped = (uint8_t *) MapViewOfFile( m_hMapping, FILE_MAP_COPY, 0, 0, 0 );
+	}
+	if ( m_pMapped == nullptr )
+	{
+		if ( m_hMapping )
+			CloseHandle( m_hMapping );
+		CloseHandle( m_hFile );
+		throw std::runtime_error( "Error: Unable to map frame archive " + strFileName );
+	}
+#else
+	const int fd = open( strFileName.c_str(), O_RDONLY );
+	if ( fd < 0 )
+		throw std::runtime_error( "Error: Unable to open frame archive " + strFileName );
+
+	// The mapping keeps the file open, so the descriptor can go
+	struct stat st;
+	if ( fstat( fd, &st ) == 0 && st.st_size > 0 )
+	{
+		m_nMappedSize = (size_t) st.st_size;
+		void * pMapped = mmap( nullptr, m_nMappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0 );
+		if ( pMapped != MAP_FAILED )
+			m_pMapped = (uint8_t *) pMapped;
+	}
+	close( fd );
+	if ( m_pMapped == nullptr )
+		throw std::runtime_error( "Error: Unable to map frame archive " + strFileName );
+
+	// If frames are read front to back let the kernel read ahead
+	// aggressively. Otherwise we're striding across the file, and
+	// sequential would drop pages we're coming back for, so leave it
+	// the normal amount of read ahead (random would fault every
+	// page of a band in on its own)
+	madvise( m_pMapped, m_nMappedSize, eAccess == Access::Sequential ? MADV_SEQUENTIAL : MADV_NORMAL );
+#endif
+
+	// Make sure it's an archive and everything's where it says it is
+	std::string strError;
+	FrameArchiveHeader header;
+	if ( m_nMappedSize < sizeof( header ) )
+	{
+		strError = "too small";
+	}
+	else
+	{
+		memcpy( &header, m_pMapped, sizeof( header ) );
+		if ( memcmp( header.acMagic, kMagic, sizeof( kMagic ) ) != 0 )
+			strError = "not a frame archive";
+		else if ( header.nVersion != kVersion )
+			strError = "unknown version";
+		else if ( header.nIndexOffset % sizeof( uint64_t ) ||
+				  header.nIndexOffset > m_nMappedSize ||
+				  ( m_nMappedSize - header.nIndexOffset ) / sizeof( FrameArchiveEntry ) < header.nFrames )
+			strError = "bad index";
+	}
+
+	if ( strError.empty() )
+	{
+		m_pIndex = (const FrameArchiveEntry *) ( m_pMapped + header.nIndexOffset );
+		m_nFrames = header.nFrames;
+		for ( size_t i = 0; i < m_nFrames && strError.empty(); i++ )
+		{
+			const FrameArchiveEntry& entry = m_pIndex[i];
+			const size_t nElemSize = entry.nType == CV_32FC1 ? 4 : entry.nType == CV_16UC1 ? 2 : 0;
+			if ( nElemSize == 0 || entry.nRows <= 0 || entry.nCols <= 0 || entry.nOffset % kFrameAlignment ||
+				 entry.nOffset > header.nIndexOffset ||
+				 ( header.nIndexOffset - entry.nOffset ) / nElemSize / entry.nCols < (uint64_t) entry.nRows )
+				strError = "bad frame " + std::to_string( i );
+		}
+	}
+
+	if ( !strError.empty() )
+	{
+#ifdef WIN32
+		UnmapViewOfFile( m_pMapped );
+		CloseHandle( m_hMapping );
+		CloseHandle( m_hFile );
+#else
+		munmap( m_pMapped, m_nMappedSize );
+#endif
+		throw std::runtime_error( "Error: Invalid frame archive " + strFileName + " (" + strError + ")" );
+	}
+}
+
+FrameArchiveReader::~FrameArchiveReader()
+{
+#ifdef WIN32
+	UnmapViewOfFile( m_pMapped );
+	CloseHandle( m_hMapping );
+	CloseHandle( m_hFile );
+#else
+	munmap( m_pMapped, m_nMappedSize );
+#endif
+}
+
+ImageSource::Status FrameArchiveReader::GetNextImage( img_t * pImg )
+{
+	if ( m_nNextFrame >= m_nFrames )
+		return Status::DONE;
+
+	cv::Mat imgFrame = GetFrameView( m_nNextFrame++ );
+
+#if SH_CUDA
+	if ( imgFrame.type() == CV_16UC1 )
+	{
+		imgFrame.convertTo( m_imgConverted, CV_32FC1, 1. / k16BitScale );
+		imgFrame = m_imgConverted;
+	}
+	img_t img = m_FramePool.Get( imgFrame.size(), CV_32FC1 );
+	img.upload( imgFrame );
+	*pImg = img;
+#else
+	if ( imgFrame.type() == CV_32FC1 )
+	{
+		*pImg = imgFrame;
+	}
+	else
+	{
+		img_t img = m_FramePool.Get( imgFrame.size(), CV_32FC1 );
+		imgFrame.convertTo( img, CV_32FC1, 1. / k16BitScale );
+		*pImg = img;
+	}
+#endif
+
+	return Status::READY;
+}
+
+void FrameArchiveReader::Rewind()
+{
+	m_nNextFrame = 0;
+}
+
+size_t FrameArchiveReader::GetFrameCount() const
+{
+	return m_nFrames;
+}
+
+cv::Mat FrameArchiveReader::GetFrameView( const size_t nFrame ) const
+{
+	if ( nFrame >= m_nFrames )
+		throw std::runtime_error( "Error: Frame archive doesn't have frame " + std::to_string( nFrame ) );
+
+	const FrameArchiveEntry& entry = m_pIndex[nFrame];
+	return cv::Mat( entry.nRows, entry.nCols, entry.nType, m_pMapped + entry.nOffset );
+}
@@ -0,0 +1,72 @@
+#include "FramePool.h"
+
+FramePool::FramePool( const size_t nMaxBuffers ) :
+	m_nMaxBuffers( nMaxBuffers ),
+	m_nAllocated( 0 )
+{
+	m_vBuffers.reserve( nMaxBuffers );
+}
+
+// A buffer is free if nobody but us is looking at it. Only whoever
+// holds a reference can make another, so if the count is 1 here it
+// can't go back up behind our back. Other threads can still drop
+// theirs, so the count is read atomically (adding 0), the same way
+// OpenCV changes it
+bool FramePool::isFree( const img_t& img )
+{
+#if SH_CUDA
+	return img.refcount && CV_XADD( img.refcount, 0 ) == 1;
+#else
+	return img.u && CV_XADD( &img.u->refcount, 0 ) == 1;
+#endif
+}
+
+img_t FramePool::Get( const cv::Size szFrame, const int nType )
+{
+	std::lock_guard<std::mutex> lg( m_muPool );
+
+	// Best case there's a free one that's already the right shape
+	img_t * pFree = nullptr;
+	for ( img_t& img : m_vBuffers )
+	{
+		if ( isFree( img ) )
+		{
+			if ( img.size() == szFrame && img.type() == nType )
+				return img;
+			if ( pFree == nullptr )
+				pFree = &img;
+		}
+	}
+
+	// Otherwise remake a free one or add another
+	m_nAllocated++;
+	if ( pFree == nullptr && m_vBuffers.size() < m_nMaxBuffers )
+	{
+		m_vBuffers.emplace_back();
+		pFree = &m_vBuffers.back();
+	}
+
+	if ( pFree != nullptr )
+	{
+		pFree->release();
+		pFree->create( szFrame, nType );
+		return *pFree;
+	}
+
+	// Everything's in use, so this one's on its own
+	return img_t( szFrame, nType );
+}
+
+void FramePool::SetMaxBuffers( const size_t nMaxBuffers )
+{
+	std::lock_guard<std::mutex> lg( m_muPool );
+	m_nMaxBuffers = nMaxBuffers;
+	if ( m_vBuffers.size() > nMaxBuffers )
+		m_vBuffers.resize( nMaxBuffers );
+}
+
+size_t FramePool::GetAllocCount() const
+{
+	std::lock_guard<std::mutex> lg( m_muPool );
+	return m_nAllocated;
+}
@@ -0,0 +1,83 @@
+#include "FrameQueue.h"
+
+FrameQueue::FrameQueue( const size_t nCapacity, const Policy ePolicy ) :
+	m_vSlots( std::max<size_t>( nCapacity, 1 ) ),
+	m_nFirst( 0 ),
+	m_nCount( 0 ),
+	m_nDropped( 0 ),
+	m_ePolicy( ePolicy ),
+	m_bClosed( false )
+{}
+
+bool FrameQueue::Push( const img_t& img )
+{
+	std::unique_lock<std::mutex> lk( m_muQueue );
+	if ( m_ePolicy == Policy::Block )
+		m_cvSpace.wait( lk, [this] () { return m_bClosed || m_nCount < m_vSlots.size(); } );
+	if ( m_bClosed )
+		return false;
+
+	// Make room by dropping the oldest frame
+	if ( m_nCount == m_vSlots.size() )
+	{
+		m_nFirst = ( m_nFirst + 1 ) % m_vSlots.size();
+		m_nCount--;
+		m_nDropped++;
+	}
+
+	// The slot after the last one is ours until we commit it (pops don't
+	// move it and we're the only pusher), so copy without the lock held
+	img_t& slot = m_vSlots[( m_nFirst + m_nCount ) % m_vSlots.size()];
+	lk.unlock();
+	img.copyTo( slot );
+	lk.lock();
+
+	m_nCount++;
+	lk.unlock();
+	m_cvFrame.notify_one();
+
+	return true;
+}
+
+ImageSource::Status FrameQueue::Pop( img_t * pImg, const std::chrono::milliseconds tTimeout )
+{
+	if ( pImg == nullptr )
+		throw std::runtime_error( "Error: Popping frame into null image!" );
+
+	std::unique_lock<std::mutex> lk( m_muQueue );
+	if ( !m_cvFrame.wait_for( lk, tTimeout, [this] () { return m_bClosed || m_nCount > 0; } ) )
+		return ImageSource::Status::WAIT;
+	if ( m_nCount == 0 )
+		return ImageSource::Status::DONE;
+
+	// Our old buffer goes back into the ring to be reused
+	std::swap( *pImg, m_vSlots[m_nFirst] );
+	m_nFirst = ( m_nFirst + 1 ) % m_vSlots.size();
+	m_nCount--;
+	lk.unlock();
+	m_cvSpace.notify_one();
+
+	return ImageSource::Status::READY;
+}
+
+void FrameQueue::Close()
+{
+	{
+		std::lock_guard<std::mutex> lg( m_muQueue );
+		m_bClosed = true;
+	}
+	m_cvFrame.notify_all();
+	m_cvSpace.notify_all();
+}
+
+bool FrameQueue::IsClosed() const
+{
+	std::lock_guard<std::mutex> lg( m_muQueue );
+	return m_bClosed;
+}
+
+size_t FrameQueue::GetDropCount() const
+{
+	std::lock_guard<std::mutex> lg( m_muQueue );
+	return m_nDropped;
+}
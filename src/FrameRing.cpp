@@ -0,0 +1,166 @@
+#include "FrameRing.h"
+
+#include <stdexcept>
+
+// The ring, the producer's buffer and the consumer's buffer
+// are all full at worst, so that's all the buffers we need
+FrameRing::FrameRing( const size_t nCapacity ) :
+	m_nCapacity( nCapacity ),
+	m_vBuffers( nCapacity + 2 ),
+	m_vGenerations( nCapacity + 2, 0 ),
+	m_vQueued( nCapacity ),
+	m_nHead( 0 ),
+	m_nTail( 0 ),
+	m_vFree( nCapacity + 2 ),
+	m_nFreeHead( 0 ),
+	m_nFreeTail( 0 ),
+	m_nPushed( 0 ),
+	m_nDropped( 0 ),
+	m_nProducerBuffer( -1 ),
+	m_nConsumerBuffer( -1 )
+{
+	if ( nCapacity == 0 )
+		throw std::runtime_error( "Error: FrameRing needs room for at least one frame!" );
+
+	// Every buffer starts out free
+	for ( size_t i = 0; i < m_vBuffers.size(); i++ )
+		releaseBuffer( (int) i );
+}
+
+// Producer side
+////////////////////////////////////////////////////
+
+// Claims the oldest queued frame's buffer, if the consumer doesn't get it first
+bool FrameRing::dropOldest( int * pnBuffer )
+{
+	size_t nTail = m_nTail.value.load( std::memory_order_acquire );
+	if ( nTail == m_nHead.value.load( std::memory_order_relaxed ) )
+		return false;
+
+	// Only we write this slot, so it's safe to read before claiming it
+	const int nBuffer = m_vQueued[nTail % m_nCapacity].load( std::memory_order_relaxed );
+	if ( !m_nTail.value.compare_exchange_strong( nTail, nTail + 1, std::memory_order_acq_rel ) )
+		return false;
+
+	m_nDropped.fetch_add( 1, std::memory_order_relaxed );
+	*pnBuffer = nBuffer;
+	return true;
+}
+
+int FrameRing::acquireBuffer()
+{
+	for ( ;; )
+	{
+		// Take a free buffer if the consumer's given one back
+		const size_t nFreeTail = m_nFreeTail.value.load( std::memory_order_relaxed );
+		if ( nFreeTail != m_nFreeHead.value.load( std::memory_order_acquire ) )
+		{
+			const int nBuffer = m_vFree[nFreeTail % m_vFree.size()].load( std::memory_order_relaxed );
+			m_nFreeTail.value.store( nFreeTail + 1, std::memory_order_release );
+			return nBuffer;
+		}
+
+		// Otherwise every buffer is queued (or the consumer is
+		// between frames) so reuse the oldest queued one
+		int nBuffer( -1 );
+		if ( dropOldest( &nBuffer ) )
+			return nBuffer;
+	}
+}
+
+img_t& FrameRing::BeginPush()
+{
+	if ( m_nProducerBuffer.value < 0 )
+		m_nProducerBuffer.value = acquireBuffer();
+	return m_vBuffers[m_nProducerBuffer.value];
+}
+
+void FrameRing::EndPush( const size_t nGeneration )
+{
+	if ( m_nProducerBuffer.value < 0 )
+		throw std::runtime_error( "Error: FrameRing::EndPush called without BeginPush!" );
+
+	// If we're full drop the oldest frame, whose buffer we'll
+	// write the next frame into. If the consumer beats us
+	// to it there's room after all
+	const size_t nHead = m_nHead.value.load( std::memory_order_relaxed );
+	int nSpareBuffer( -1 );
+	while ( nHead - m_nTail.value.load( std::memory_order_acquire ) >= m_nCapacity )
+	{
+		if ( dropOldest( &nSpareBuffer ) )
+			break;
+	}
+
+	// Publish our buffer
+	m_vGenerations[m_nProducerBuffer.value] = nGeneration;
+	m_vQueued[nHead % m_nCapacity].store( m_nProducerBuffer.value, std::memory_order_relaxed );
+	m_nHead.value.store( nHead + 1, std::memory_order_release );
+	m_nPushed.value.fetch_add( 1, std::memory_order_relaxed );
+
+	m_nProducerBuffer.value = nSpareBuffer;
+}
+
+// Consumer side
+////////////////////////////////////////////////////
+
+void FrameRing::releaseBuffer( const int nBuffer )
+{
+	const size_t nFreeHead = m_nFreeHead.value.load( std::memory_order_relaxed );
+	m_vFree[nFreeHead % m_vFree.size()].store( nBuffer, std::memory_order_relaxed );
+	m_nFreeHead.value.store( nFreeHead + 1, std::memory_order_release );
+}
+
+bool FrameRing::Pop( img_t * pImg, const size_t nMinGeneration )
+{
+	if ( pImg == nullptr )
+		throw std::runtime_error( "Error: Popping frame into null image!" );
+
+	for ( ;; )
+	{
+		size_t nTail = m_nTail.value.load( std::memory_order_acquire );
+		if ( nTail == m_nHead.value.load( std::memory_order_acquire ) )
+			return false;
+
+		// If the producer drops this frame while we're looking
+		// at it the CAS fails and we try the next one
+		const int nBuffer = m_vQueued[nTail % m_nCapacity].load( std::memory_order_relaxed );
+		if ( m_nTail.value.compare_exchange_weak( nTail, nTail + 1, std::memory_order_acq_rel ) )
+		{
+			// It's ours now; if it's stale give it straight back
+			if ( m_vGenerations[nBuffer] < nMinGeneration )
+			{
+				releaseBuffer( nBuffer );
+				continue;
+			}
+
+			// Hand back the frame we gave out last time
+			if ( m_nConsumerBuffer.value >= 0 )
+				releaseBuffer( m_nConsumerBuffer.value );
+
+			m_nConsumerBuffer.value = nBuffer;
+			*pImg = m_vBuffers[nBuffer];
+			return true;
+		}
+	}
+}
+
+void FrameRing::Clear()
+{
+	img_t img;
+	while ( Pop( &img ) );
+}
+
+bool FrameRing::Empty() const
+{
+	return m_nTail.value.load( std::memory_order_acquire ) == m_nHead.value.load( std::memory_order_acquire );
+}
+
+size_t FrameRing::GetPushCount() const
+{
+	return m_nPushed.value.load( std::memory_order_relaxed );
+}
+
+size_t FrameRing::GetDropCount() const
+{
+	return m_nDropped.load( std::memory_order_relaxed );
+}
@@ -0,0 +1,204 @@
+#include "FrameStacker.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <stdint.h>
+#include <string.h>
+
+// The deviation of fewer frames than this means
+// nothing, so until then every pixel's accepted
+const size_t kMinClipFrames = 3;
+
+// A pixel's deviation is never taken as less than one step of an 8 bit
+// frame. Otherwise a constant pixel (dark sky, or one clipped at full
+// scale) clips anything at all that comes along, and the running sums'
+// rounding can leave its variance tiny rather than zero. (Quantization
+// noise alone, a twelfth of a step squared, would still clip a one step
+// flicker at 3 sigma)
+const double kMinClipVar = ( 1. / 255 ) * ( 1. / 255 );
+
+FrameStacker::FrameStacker( const size_t nWindow, const Mode eMode, const float fClipSigma ) :
+	m_nWindow( 0 ),
+	m_eMode( eMode ),
+	m_fClipSigma( fClipSigma ),
+	m_nCount( 0 ),
+	m_nNext( 0 )
+{
+	SetWindow( nWindow, eMode, fClipSigma );
+}
+
+void FrameStacker::SetWindow( const size_t nWindow, const Mode eMode, const float fClipSigma )
+{
+	if ( nWindow == 0 )
+		throw std::runtime_error( "Error: FrameStacker needs a window of at least one frame!" );
+
+	m_nWindow = nWindow;
+	m_eMode = eMode;
+	m_fClipSigma = fClipSigma;
+	m_vFrames.resize( nWindow );
+	m_vAccepted.resize( eMode == Mode::SigmaClip ? nWindow : 0 );
+	Reset();
+}
+
+void FrameStacker::Reset()
+{
+	m_nCount = 0;
+	m_nNext = 0;
+	m_szFrame = cv::Size();
+}
+
+size_t FrameStacker::GetCount() const
+{
+	return m_nCount;
+}
+
+size_t FrameStacker::GetWindow() const
+{
+	return m_nWindow;
+}
+
+FrameStacker::Mode FrameStacker::GetMode() const
+{
+	return m_eMode;
+}
+
+void FrameStacker::Push( const cv::Mat& img )
+{
+	if ( img.type() != CV_32FC1 )
+		throw std::runtime_error( "Error: FrameStacker only stacks single channel float images!" );
+
+	// New size, so start over (the buffers are only made here)
+	const bool bClip = m_eMode == Mode::SigmaClip;
+	if ( img.size() != m_szFrame )
+	{
+		Reset();
+		m_szFrame = img.size();
+		m_imgSum.create( m_szFrame, CV_64FC1 );
+		m_imgSum.setTo( 0 );
+		if ( bClip )
+		{
+			m_imgSumSq.create( m_szFrame, CV_64FC1 );
+			m_imgSumSq.setTo( 0 );
+			m_imgClipSum.create( m_szFrame, CV_64FC1 );
+			m_imgClipSum.setTo( 0 );
+			m_imgClipCount.create( m_szFrame, CV_32SC1 );
+			m_imgClipCount.setTo( 0 );
+		}
+	}
+
+	// The frame in this slot (if the window's full) is the one leaving
+	const bool bFull = m_nCount == m_nWindow;
+	cv::Mat& imgSlot = m_vFrames[m_nNext];
+	imgSlot.create( m_szFrame, CV_32FC1 );
+	if ( bClip )
+		m_vAccepted[m_nNext].create( m_szFrame, CV_8UC1 );
+
+	// Once the oldest frame is out, this is how many the new one joins
+	const size_t nOthers = bFull ? m_nWindow - 1 : m_nCount;
+	const bool bCheckClip = bClip && nOthers >= kMinClipFrames;
+	const double dInvOthers = nOthers ? 1. / nOthers : 0.;
+	const double dClipSigmaSq = double( m_fClipSigma ) * m_fClipSigma;
+	const int nCols = m_szFrame.width;
+
+#pragma omp parallel for
+	for ( int y = 0; y < m_szFrame.height; y++ )
+	{
+		const float * pIn = img.ptr<float>( y );
+		float * pSlot = imgSlot.ptr<float>( y );
+		double * pSum = m_imgSum.ptr<double>( y );
+
+		if ( !bClip )
+		{
+#pragma omp simd
+			for ( int x = 0; x < nCols; x++ )
+			{
+				const double dOld = bFull ? pSlot[x] : 0.;
+				pSum[x] += double( pIn[x] ) - dOld;
+			}
+		}
+		else
+		{
+			double * pSumSq = m_imgSumSq.ptr<double>( y );
+			double * pClipSum = m_imgClipSum.ptr<double>( y );
+			int32_t * pClipCount = m_imgClipCount.ptr<int32_t>( y );
+			uint8_t * pAccepted = m_vAccepted[m_nNext].ptr<uint8_t>( y );
+
+			for ( int x = 0; x < nCols; x++ )
+			{
+				// Take the oldest frame out
+				if ( bFull )
+				{
+					const double dOld = pSlot[x];
+					pSum[x] -= dOld;
+					pSumSq[x] -= dOld * dOld;
+					if ( pAccepted[x] )
+					{
+						pClipSum[x] -= dOld;
+						pClipCount[x]--;
+					}
+				}
+
+				// Compare the new one to what's left
+				const double dNew = pIn[x];
+				bool bAccept = true;
+				if ( bCheckClip )
+				{
+					const double dMean = pSum[x] * dInvOthers;
+					const double dVar = std::max( kMinClipVar, pSumSq[x] * dInvOthers - dMean * dMean );
+					const double dDiff = dNew - dMean;
+					bAccept = dDiff * dDiff <= dClipSigmaSq * dVar;
+				}
+
+				pSum[x] += dNew;
+				pSumSq[x] += dNew * dNew;
+				pAccepted[x] = bAccept;
+				if ( bAccept )
+				{
+					pClipSum[x] += dNew;
+					pClipCount[x]++;
+				}
+			}
+		}
+
+		memcpy( pSlot, pIn, nCols * sizeof( float ) );
+	}
+
+	m_nNext = ( m_nNext + 1 ) % m_nWindow;
+	m_nCount = std::min( m_nCount + 1, m_nWindow );
+}
+
+void FrameStacker::GetStacked( cv::Mat& imgStacked ) const
+{
+	if ( m_nCount == 0 )
+	{
+		imgStacked.release();
+		return;
+	}
+
+	imgStacked.create( m_szFrame, CV_32FC1 );
+	const double dInvCount = 1. / m_nCount;
+	const bool bClip = m_eMode == Mode::SigmaClip;
+	const int nCols = m_szFrame.width;
+
+#pragma omp parallel for
+	for ( int y = 0; y < m_szFrame.height; y++ )
+	{
+		const double * pSum = m_imgSum.ptr<double>( y );
+		float * pOut = imgStacked.ptr<float>( y );
+		if ( !bClip )
+		{
+#pragma omp simd
+			for ( int x = 0; x < nCols; x++ )
+				pOut[x] = float( pSum[x] * dInvCount );
+		}
+		else
+		{
+			// If every frame was an outlier somehow, use the plain mean
+			const double * pClipSum = m_imgClipSum.ptr<double>( y );
+			const int32_t * pClipCount = m_imgClipCount.ptr<int32_t>( y );
+			for ( int x = 0; x < nCols; x++ )
+				pOut[x] = float( pClipCount[x] ? pClipSum[x] / pClipCount[x] : pSum[x] * dInvCount );
+		}
+	}
+}
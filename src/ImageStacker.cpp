@@ -0,0 +1,245 @@
+#include "ImageStacker.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+// Registration needs a few stars to make triangles out of
+const size_t kMinReferenceStars = 4;
+
+// Frames are combined this many rows at a time
+const int kBandRows = 16;
+
+// Sigma clipping stops after this many passes,
+// or once there are too few values to clip
+const int kMaxClipPasses = 5;
+const int kMinClipValues = 3;
+
+// Warped pixels that don't land on the frame get this,
+// which is how we know to leave them out of the stack
+const float kNoPixel = std::numeric_limits<float>::quiet_NaN();
+
+// Reorders pValues
+static float medianOf( float * pValues, const int nValues )
+{
+	const int nMid = nValues / 2;
+	std::nth_element( pValues, pValues + nMid, pValues + nValues );
+	if ( nValues % 2 )
+		return pValues[nMid];
+
+	// Even, so average the middle two (the other one is
+	// the biggest of what nth_element put below the middle)
+	return .5f * ( pValues[nMid] + *std::max_element( pValues, pValues + nMid ) );
+}
+
+static float meanOf( const float * pValues, const int nValues )
+{
+	double dSum = 0;
+	for ( int i = 0; i < nValues; i++ )
+		dSum += pValues[i];
+	return float( dSum / nValues );
+}
+
+// Reorders pValues
+static float sigmaClippedMeanOf( float * pValues, int nValues, const float fClipSigma )
+{
+	for ( int nPass = 0; nPass < kMaxClipPasses && nValues >= kMinClipValues; nPass++ )
+	{
+		const float fMedian = medianOf( pValues, nValues );
+
+		double dSum = 0, dSumSq = 0;
+		for ( int i = 0; i < nValues; i++ )
+		{
+			dSum += pValues[i];
+			dSumSq += double( pValues[i] ) * pValues[i];
+		}
+		const double dMean = dSum / nValues;
+		const double dLimit = fClipSigma * sqrt( std::max( 0., dSumSq / nValues - dMean * dMean ) );
+
+		// Keep what's close enough to the median
+		int nKept = 0;
+		for ( int i = 0; i < nValues; i++ )
+			if ( std::fabs( pValues[i] - fMedian ) <= dLimit )
+				pValues[nKept++] = pValues[i];
+
+		if ( nKept == nValues || nKept == 0 )
+			break;
+		nValues = nKept;
+	}
+
+	return meanOf( pValues, nValues );
+}
+
+ImageStacker::ImageStacker( const std::string& strOutputFile, const std::string& strScratchFile,
+							const Integration eIntegration, const float fClipSigma ) :
+	StarFinder(),
+	m_strOutputFile( strOutputFile ),
+	m_strScratchFile( strScratchFile ),
+	m_eIntegration( eIntegration ),
+	m_fClipSigma( fClipSigma ),
+	m_nStacked( 0 ),
+	m_nRejected( 0 )
+{}
+
+ImageStacker::~ImageStacker()
+{
+	// If we never got finalized don't leave the scratch file around
+	if ( m_upScratch )
+	{
+		m_upScratch.reset();
+		std::remove( m_strScratchFile.c_str() );
+	}
+}
+
+bool ImageStacker::HandleImage( const img_t& img )
+{
+	if ( !findStars( img ) )
+		return false;
+
+	// Registration and warping happen on the host
+#if SH_CUDA
+	img.download( m_imgHost );
+	const cv::Mat& hImg = m_imgHost;
+#else
+	const cv::Mat& hImg = img;
+#endif
+
+	std::vector<Circle> vStars = locateStars( hImg );
+
+	// The first frame with enough stars is the reference,
+	// so it goes into the stack as it is
+	if ( !m_upRegistration )
+	{
+		if ( vStars.size() < kMinReferenceStars )
+		{
+			m_nRejected++;
+			return true;
+		}
+
+		m_upRegistration.reset( new StarRegistration( vStars ) );
+		m_szFrame = hImg.size();
+		m_upScratch.reset( new FrameArchiveWriter( m_strScratchFile ) );
+		m_upScratch->Append( hImg );
+		m_nStacked++;
+		return true;
+	}
+
+	// Find where the reference stars are in this frame
+	StarTransform xf;
+	if ( hImg.size() != m_szFrame || !m_upRegistration->Register( vStars, &xf ) )
+	{
+		m_nRejected++;
+		return true;
+	}
+
+	// The transform takes reference pixels to this frame's, which
+	// is the inverse map warpAffine needs to pull it onto the reference
+	const double dCos = xf.fScale * cos( xf.fRotation );
+	const double dSin = xf.fScale * sin( xf.fRotation );
+	double adMap[6] = { dCos, -dSin, xf.fTransX, dSin, dCos, xf.fTransY };
+	const cv::Mat matMap( 2, 3, CV_64FC1, adMap );
+	cv::warpAffine( hImg, m_imgWarped, matMap, m_szFrame, cv::INTER_LINEAR | cv::WARP_INVERSE_MAP, cv::BORDER_CONSTANT, cv::Scalar( kNoPixel ) );
+
+	m_upScratch->Append( m_imgWarped );
+	m_nStacked++;
+
+	return true;
+}
+
+void ImageStacker::Finalize()
+{
+	// Nothing registered, nothing to stack
+	if ( !m_upScratch )
+		return;
+
+	m_upScratch->Finalize();
+	m_upScratch.reset();
+
+	// The reader has to be gone before the file is. We read
+	// bands of every frame at once, not frame after frame
+	{
+		FrameArchiveReader frames( m_strScratchFile, FrameArchiveReader::Access::Scattered );
+		combine( frames );
+	}
+	std::remove( m_strScratchFile.c_str() );
+
+	// Written scaled the way FileReader reads 16 bit pngs
+	if ( !m_strOutputFile.empty() )
+	{
+		cv::Mat imgOut;
+		m_imgStacked.convertTo( imgOut, CV_16UC1, double( 1 << 16 ) );
+		if ( !cv::imwrite( m_strOutputFile, imgOut ) )
+			throw std::runtime_error( "Error: Unable to write stacked image " + m_strOutputFile );
+	}
+}
+
+void ImageStacker::combine( const FrameArchiveReader& frames )
+{
+	const int nFrames = (int) frames.GetFrameCount();
+	std::vector<cv::Mat> vFrames( nFrames );
+	for ( int i = 0; i < nFrames; i++ )
+		vFrames[i] = frames.GetFrameView( i );
+
+	m_imgStacked.create( m_szFrame, CV_32FC1 );
+	const int nCols = m_szFrame.width;
+	const int nBands = ( m_szFrame.height + kBandRows - 1 ) / kBandRows;
+
+#pragma omp parallel
+	{
+		// Each thread copies a row of every frame in, so a
+		// pixel's values across the frames are close together
+		std::vector<float> vRows( (size_t) nFrames * nCols );
+		std::vector<float> vValues( nFrames );
+
+#pragma omp for schedule( dynamic )
+		for ( int nBand = 0; nBand < nBands; nBand++ )
+		{
+			const int nEndRow = std::min( ( nBand + 1 ) * kBandRows, m_szFrame.height );
+			for ( int y = nBand * kBandRows; y < nEndRow; y++ )
+			{
+				for ( int i = 0; i < nFrames; i++ )
+					std::copy_n( vFrames[i].ptr<float>( y ), nCols, &vRows[(size_t) i * nCols] );
+
+				float * pOut = m_imgStacked.ptr<float>( y );
+				for ( int x = 0; x < nCols; x++ )
+				{
+					// Leave out frames that don't cover this pixel
+					int nValues = 0;
+					for ( int i = 0; i < nFrames; i++ )
+					{
+						const float fValue = vRows[(size_t) i * nCols + x];
+						if ( !std::isnan( fValue ) )
+							vValues[nValues++] = fValue;
+					}
+
+					if ( nValues == 0 )
+						pOut[x] = 0;
+					else if ( m_eIntegration == Integration::Median )
+						pOut[x] = medianOf( vValues.data(), nValues );
+					else if ( m_eIntegration == Integration::SigmaClip )
+						pOut[x] = sigmaClippedMeanOf( vValues.data(), nValues, m_fClipSigma );
+					else
+						pOut[x] = meanOf( vValues.data(), nValues );
+				}
+			}
+		}
+	}
+}
+
+const cv::Mat& ImageStacker::GetStacked() const
+{
+	return m_imgStacked;
+}
+
+size_t ImageStacker::GetStackedCount() const
+{
+	return m_nStacked;
+}
+
+size_t ImageStacker::GetRejectedCount() const
+{
+	return m_nRejected;
+}
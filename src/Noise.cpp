@@ -0,0 +1,40 @@
+#include "Noise.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+void AddNoise( cv::Mat& img, const NoiseModel& noise, const uint64_t nSeed )
+{
+	if ( img.type() != CV_32FC1 )
+		throw std::runtime_error( "Error: AddNoise only works on single channel float images!" );
+	if ( noise.IsNone() )
+		return;
+
+	const float fReadVar = noise.fReadNoise * noise.fReadNoise;
+	const float fInvFullWell = noise.fFullWell > 0 ? 1.f / noise.fFullWell : 0.f;
+	const float fTwoPi = 6.2831853f;
+
+	// Every row gets its own generator, seeded from its index,
+	// so it doesn't matter which thread does which row
+#pragma omp parallel for
+	for ( int y = 0; y < img.rows; y++ )
+	{
+		SplitMix64 rng( SplitMix64( nSeed ).Next() ^ ( uint64_t( y ) * 0xd1b54a32d192ed03ull ) );
+		float * pRow = img.ptr<float>( y );
+		for ( int x = 0; x < img.cols; x += 2 )
+		{
+			// Box-Muller, two normals at a time
+			const float fR = std::sqrt( -2.f * std::log( 1.f - rng.Uniform() ) );
+			const float fTheta = fTwoPi * rng.Uniform();
+			const float afNormal[2] = { fR * std::cos( fTheta ), fR * std::sin( fTheta ) };
+
+			for ( int i = 0; i < 2 && x + i < img.cols; i++ )
+			{
+				float& fPixel = pRow[x + i];
+				const float fVar = fReadVar + std::max( fPixel, 0.f ) * fInvFullWell;
+				fPixel += std::sqrt( fVar ) * afNormal[i];
+			}
+		}
+	}
+}
@@ -0,0 +1,210 @@
+#include "StarField.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+// Frames are rendered this many rows at a time
+const int kBandRows = 32;
+
+// The PSF is cut off this many sigmas out
+const float kPSFSigmas = 4.f;
+
+// FWHM of a gaussian in sigmas
+const float kFWHMSigmas = 2.3548f;
+
+const float kTwoPi = 6.2831853f;
+
+StarFieldSource::StarFieldSource( const StarFieldParams& params ) :
+	m_Params( params ),
+	m_nNextFrame( 0 )
+{
+	if ( params.szFrame.width <= 0 || params.szFrame.height <= 0 )
+		throw std::runtime_error( "Error: Star field needs a frame size!" );
+	if ( params.fFWHM <= 0 )
+		throw std::runtime_error( "Error: Star field FWHM has to be positive!" );
+	if ( params.fMinPeak <= 0 || params.fMaxPeak < params.fMinPeak )
+		throw std::runtime_error( "Error: Star field peak intensities make no sense!" );
+
+	SplitMix64 rng( params.nSeed );
+
+	// Scatter the stars; a gaussian's total flux is its peak
+	// times 2 pi sigma^2 (integrating over the pixels takes a
+	// little off the peak, more so for small FWHMs)
+	const float fSigma = params.fFWHM / kFWHMSigmas;
+	const float fPeakToFlux = kTwoPi * fSigma * fSigma;
+	const float fLogPeakRange = std::log( params.fMaxPeak / params.fMinPeak );
+	m_vStars.reserve( params.nStars );
+	m_vFlux.reserve( params.nStars );
+	for ( size_t i = 0; i < params.nStars; i++ )
+	{
+		const float fX = rng.Uniform() * params.szFrame.width - .5f;
+		const float fY = rng.Uniform() * params.szFrame.height - .5f;
+		const float fPeak = params.fMinPeak * std::exp( fLogPeakRange * rng.Uniform() );
+		m_vStars.push_back( { fX, fY, params.fFWHM } );
+		m_vFlux.push_back( fPeak * fPeakToFlux );
+	}
+
+	// Pick the hot pixels
+	const size_t nPixels = (size_t) params.szFrame.area();
+	const size_t nHotPixels = std::min( nPixels, (size_t) std::lround( params.fHotPixelFraction * nPixels ) );
+	m_vHotPixels.reserve( nHotPixels );
+	for ( size_t i = 0; i < nHotPixels; i++ )
+		m_vHotPixels.emplace_back( rng.Next() % nPixels, params.fHotPixelValue );
+	std::sort( m_vHotPixels.begin(), m_vHotPixels.end() );
+}
+
+ImageSource::Status StarFieldSource::GetNextImage( img_t * pImg )
+{
+	if ( m_nNextFrame >= m_Params.nFrames )
+		return Status::DONE;
+
+	img_t img = m_FramePool.Get( m_Params.szFrame, CV_32FC1 );
+#if SH_CUDA
+	Render( m_nNextFrame++, m_imgRender );
+	img.upload( m_imgRender );
+#else
+	Render( m_nNextFrame++, img );
+#endif
+
+	*pImg = img;
+	return Status::READY;
+}
+
+void StarFieldSource::Rewind()
+{
+	m_nNextFrame = 0;
+}
+
+void StarFieldSource::GetMotion( const size_t nFrame, float * pfShiftX, float * pfShiftY, float * pfRotation ) const
+{
+	if ( pfShiftX )
+		*pfShiftX = m_Params.fDriftX * nFrame;
+	if ( pfShiftY )
+		*pfShiftY = m_Params.fDriftY * nFrame;
+	if ( pfRotation )
+		*pfRotation = m_Params.fRotation * nFrame;
+}
+
+std::vector<Circle> StarFieldSource::GetStars( const size_t nFrame ) const
+{
+	float fShiftX, fShiftY, fRotation;
+	GetMotion( nFrame, &fShiftX, &fShiftY, &fRotation );
+
+	// Turn about the center, then shift
+	const float fCos = std::cos( fRotation );
+	const float fSin = std::sin( fRotation );
+	const float fCenterX = .5f * ( m_Params.szFrame.width - 1 );
+	const float fCenterY = .5f * ( m_Params.szFrame.height - 1 );
+
+	std::vector<Circle> vStars;
+	vStars.reserve( m_vStars.size() );
+	for ( const Circle c : m_vStars )
+	{
+		const float fX = c.fX - fCenterX;
+		const float fY = c.fY - fCenterY;
+		vStars.push_back( { fCos * fX - fSin * fY + fCenterX + fShiftX, fSin * fX + fCos * fY + fCenterY + fShiftY, c.fR } );
+	}
+
+	return vStars;
+}
+
+void StarFieldSource::Render( const size_t nFrame, cv::Mat& imgFrame ) const
+{
+	const int nCols = m_Params.szFrame.width;
+	const int nRows = m_Params.szFrame.height;
+	imgFrame.create( m_Params.szFrame, CV_32FC1 );
+
+	const std::vector<Circle> vStars = GetStars( nFrame );
+	const float fSigma = m_Params.fFWHM / kFWHMSigmas;
+	const int nRadius = (int) std::ceil( kPSFSigmas * fSigma );
+	const float fErfScale = 1.f / ( std::sqrt( 2.f ) * fSigma );
+
+	// Put each star in every band its PSF touches (in the order
+	// they were made, so every pixel's sum comes out the same)
+	const int nBands = ( nRows + kBandRows - 1 ) / kBandRows;
+	std::vector<std::vector<int>> vBandStars( nBands );
+	for ( int i = 0; i < (int) vStars.size(); i++ )
+	{
+		const Circle c = vStars[i];
+		const int nX = (int) std::floor( c.fX + .5f );
+		const int nY = (int) std::floor( c.fY + .5f );
+		if ( nX + nRadius < 0 || nX - nRadius >= nCols || nY + nRadius < 0 || nY - nRadius >= nRows )
+			continue;
+
+		const int nFirstBand = std::max( nY - nRadius, 0 ) / kBandRows;
+		const int nLastBand = std::min( nY + nRadius, nRows - 1 ) / kBandRows;
+		for ( int b = nFirstBand; b <= nLastBand; b++ )
+			vBandStars[b].push_back( i );
+	}
+
+	const float fCenterX = .5f * ( nCols - 1 );
+	const float fCenterY = .5f * ( nRows - 1 );
+
+#pragma omp parallel
+	{
+		// How much of a star lands in each column and row of its window
+		std::vector<float> vWeightX( 2 * nRadius + 1 );
+		std::vector<float> vWeightY( 2 * nRadius + 1 );
+
+#pragma omp for schedule( dynamic )
+		for ( int b = 0; b < nBands; b++ )
+		{
+			const int nBeginRow = b * kBandRows;
+			const int nEndRow = std::min( nBeginRow + kBandRows, nRows );
+
+			// Sky
+			for ( int y = nBeginRow; y < nEndRow; y++ )
+			{
+				float * pRow = imgFrame.ptr<float>( y );
+				const float fRowSky = m_Params.fBackground + m_Params.fGradientY * ( y - fCenterY );
+				for ( int x = 0; x < nCols; x++ )
+					pRow[x] = fRowSky + m_Params.fGradientX * ( x - fCenterX );
+			}
+
+			// Stars, each pixel gets the integral of the PSF over it
+			// (the gaussian's separable, so that's a row times a column)
+			for ( const int i : vBandStars[b] )
+			{
+				const Circle c = vStars[i];
+				const int nX = (int) std::floor( c.fX + .5f );
+				const int nY = (int) std::floor( c.fY + .5f );
+				const int nX0 = std::max( nX - nRadius, 0 );
+				const int nX1 = std::min( nX + nRadius + 1, nCols );
+				const int nY0 = std::max( nY - nRadius, nBeginRow );
+				const int nY1 = std::min( nY + nRadius + 1, nEndRow );
+
+				for ( int x = nX0; x < nX1; x++ )
+					vWeightX[x - nX0] = .5f * ( std::erf( ( x + .5f - c.fX ) * fErfScale ) - std::erf( ( x - .5f - c.fX ) * fErfScale ) );
+				for ( int y = nY0; y < nY1; y++ )
+					vWeightY[y - nY0] = m_vFlux[i] * .5f * ( std::erf( ( y + .5f - c.fY ) * fErfScale ) - std::erf( ( y - .5f - c.fY ) * fErfScale ) );
+
+				for ( int y = nY0; y < nY1; y++ )
+				{
+					float * pRow = imgFrame.ptr<float>( y );
+					const float fWeightY = vWeightY[y - nY0];
+					for ( int x = nX0; x < nX1; x++ )
+						pRow[x] += fWeightY * vWeightX[x - nX0];
+				}
+			}
+
+			// Hot pixels in these rows
+			auto itHot = std::lower_bound( m_vHotPixels.begin(), m_vHotPixels.end(), (size_t) nBeginRow * nCols,
+										   [] ( const std::pair<size_t, float>& hot, const size_t nPixel ) { return hot.first < nPixel; } );
+			for ( ; itHot != m_vHotPixels.end() && itHot->first < (size_t) nEndRow * nCols; ++itHot )
+				imgFrame.ptr<float>( int( itHot->first / nCols ) )[itHot->first % nCols] += itHot->second;
+		}
+	}
+
+	// Noise (different every frame, but the same every time for a frame)
+	AddNoise( imgFrame, m_Params.noise, SplitMix64( m_Params.nSeed ).Next() + nFrame );
+
+	// Then it saturates like a sensor would
+#pragma omp parallel for
+	for ( int y = 0; y < nRows; y++ )
+	{
+		float * pRow = imgFrame.ptr<float>( y );
+		for ( int x = 0; x < nCols; x++ )
+			pRow[x] = std::min( std::max( pRow[x], 0.f ), 1.f );
+	}
+}
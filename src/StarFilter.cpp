@@ -0,0 +1,635 @@
+#include "StarFilter.h"
+#include "Util.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <stdint.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Tile dimensions for the tiled filters. At our max radii a
+// tile streams ~60 rows of 300 columns (input window, column
+// sums, peak ring), which fits comfortably in a core's L2
+const int kTileCols = 256;
+const int kTileRows = 512;
+
+// OpenCV's default border, BORDER_REFLECT_101 (gfedcb|abcdefgh|gfedcba)
+static inline int reflect101( int p, const int nLen )
+{
+	if ( nLen == 1 )
+		return 0;
+	while ( p < 0 || p >= nLen )
+		p = p < 0 ? -p : 2 * nLen - 2 - p;
+	return p;
+}
+
+// Measure the half width of every row of a centered byte mask
+static std::vector<int> getHalfWidths( const cv::Mat& mask )
+{
+	std::vector<int> vRet( mask.rows, -1 );
+	const int nCenter = mask.cols / 2;
+	for ( int y = 0; y < mask.rows; y++ )
+	{
+		const uint8_t * pRow = mask.ptr<uint8_t>( y );
+		for ( int x = 0; x <= nCenter; x++ )
+		{
+			if ( pRow[x] )
+			{
+				vRet[y] = nCenter - x;
+				break;
+			}
+		}
+	}
+	return vRet;
+}
+
+static cv::Mat getCircleMask( const int nRadius )
+{
+	const int nDiameter = 2 * nRadius + 1;
+	cv::Mat hCircle = cv::Mat::zeros( cv::Size( nDiameter, nDiameter ), CV_8U );
+	cv::circle( hCircle, cv::Point( nRadius, nRadius ), nRadius, 1, -1 );
+	return hCircle;
+}
+
+std::vector<int> GetCircleHalfWidths( const int nRadius )
+{
+	return getHalfWidths( getCircleMask( nRadius ) );
+}
+
+std::vector<int> GetEllipseHalfWidths( const int nRadius )
+{
+	const int nDiameter = 2 * nRadius + 1;
+	return getHalfWidths( cv::getStructuringElement( cv::MORPH_ELLIPSE, cv::Size( nDiameter, nDiameter ) ) );
+}
+
+// A run of image columns padded by some radius on either side,
+// reflected at the image border; padded index j is image column
+// nFirst + j. The in-image part is contiguous, so row passes run
+// over that and then get reflected out into the padding
+struct PaddedCols
+{
+	int nFirst;
+	int nCols;
+	int nIn0;
+	int nIn1;
+	std::vector<int> vReflected;	// Padded index each pad column copies
+
+	void Init( const int x0, const int nWidth, const int nRadius, const int nImgWidth )
+	{
+		nFirst = x0 - nRadius;
+		nCols = nWidth + 2 * nRadius;
+		nIn0 = std::max( 0, nFirst ) - nFirst;
+		nIn1 = std::min( nImgWidth, nFirst + nCols ) - nFirst;
+		vReflected.resize( nCols );
+		for ( int j = 0; j < nCols; j++ )
+			vReflected[j] = reflect101( nFirst + j, nImgWidth ) - nFirst;
+	}
+
+	// Pointer to the first in-image column of an image row
+	const float * InputRow( const cv::Mat& input, const int y ) const
+	{
+		return input.ptr<float>( y ) + nFirst + nIn0;
+	}
+
+	void Reflect( float * pRow ) const
+	{
+		for ( int j = 0; j < nIn0; j++ )
+			pRow[j] = pRow[vReflected[j]];
+		for ( int j = nIn1; j < nCols; j++ )
+			pRow[j] = pRow[vReflected[j]];
+	}
+};
+
+// The top hat kernel is a normalized disk. Each column of that disk is a
+// vertical span centered on the output row, so we build the vertical sums
+// of the input for every half height h = 0..nRadius (each one is the last
+// plus two rows) and then add up one shifted sum row per disk column.
+// That's ~4r adds per pixel, all contiguous float rows, and no multiplies,
+// where filter2D with the (2r+1)^2 kernel does a MAC per kernel element
+struct DiskSumKernel
+{
+	int nRadius;
+	std::vector<int> vColHalfHeights;	// Per disk column, -1 if empty
+	float fNorm;						// 1 / # of pixels in the disk
+
+	DiskSumKernel( const int nDiskRadius ) :
+		nRadius( nDiskRadius ),
+		vColHalfHeights( getHalfWidths( getCircleMask( nDiskRadius ).t() ) )
+	{
+		int nArea = 0;
+		for ( int nHH : vColHalfHeights )
+			nArea += nHH >= 0 ? 2 * nHH + 1 : 0;
+		fNorm = 1.f / nArea;
+	}
+
+	// Fill nRadius + 1 rows of pc.nCols column sums for image row p
+	void ColumnSums( const cv::Mat& input, const int p, const PaddedCols& pc, float * pColSums ) const
+	{
+		const int nHeight = input.rows;
+		const int nIn = pc.nIn1 - pc.nIn0;
+
+		std::copy( pc.InputRow( input, p ), pc.InputRow( input, p ) + nIn, pColSums + pc.nIn0 );
+		for ( int h = 1; h <= nRadius; h++ )
+		{
+			const float * pPrev = pColSums + ( h - 1 ) * pc.nCols + pc.nIn0;
+			const float * pAbove = pc.InputRow( input, reflect101( p - h, nHeight ) );
+			const float * pBelow = pc.InputRow( input, reflect101( p + h, nHeight ) );
+			float * pCur = pColSums + h * pc.nCols + pc.nIn0;
+#pragma omp simd
+			for ( int x = 0; x < nIn; x++ )
+				pCur[x] = pPrev[x] + pAbove[x] + pBelow[x];
+		}
+
+		for ( int h = 0; h <= nRadius; h++ )
+			pc.Reflect( pColSums + h * pc.nCols );
+	}
+
+	// Disk mean for nCols outputs; output x is padded index x + nRadius
+	void MeanRow( const float * pColSums, const int nPadCols, const int nCols, float * pOut ) const
+	{
+		std::fill( pOut, pOut + nCols, 0.f );
+		for ( int dx = -nRadius; dx <= nRadius; dx++ )
+		{
+			const int nHH = vColHalfHeights[dx + nRadius];
+			if ( nHH < 0 )
+				continue;
+
+			const float * pSrc = pColSums + nHH * nPadCols + nRadius + dx;
+#pragma omp simd
+			for ( int x = 0; x < nCols; x++ )
+				pOut[x] += pSrc[x];
+		}
+
+#pragma omp simd
+		for ( int x = 0; x < nCols; x++ )
+			pOut[x] *= fNorm;
+	}
+};
+
+void DiskMeanFilter( const int nRadius, const cv::Mat& input, cv::Mat& output )
+{
+	if ( input.empty() || input.type() != CV_32F )
+		throw std::runtime_error( "Error: DiskMeanFilter needs a float image!" );
+
+	// We read rows around the one we write, so don't work in place
+	cv::Mat src = input.data == output.data ? input.clone() : input;
+	output.create( src.size(), CV_32F );
+
+	const DiskSumKernel disk( nRadius );
+	const int nTilesX = ( src.cols + kTileCols - 1 ) / kTileCols;
+	const int nTilesY = ( src.rows + kTileRows - 1 ) / kTileRows;
+	const int nTiles = nTilesX * nTilesY;
+#pragma omp parallel
+	{
+		PaddedCols pc;
+		std::vector<float> vColSums;
+#pragma omp for schedule( dynamic )
+		for ( int t = 0; t < nTiles; t++ )
+		{
+			const int x0 = ( t % nTilesX ) * kTileCols;
+			const int y0 = ( t / nTilesX ) * kTileRows;
+			const int nCols = std::min( kTileCols, src.cols - x0 );
+			const int nRows = std::min( kTileRows, src.rows - y0 );
+
+			pc.Init( x0, nCols, nRadius, src.cols );
+			vColSums.resize( ( nRadius + 1 ) * pc.nCols );
+			for ( int y = y0; y < y0 + nRows; y++ )
+			{
+				disk.ColumnSums( src, y, pc, vColSums.data() );
+				disk.MeanRow( vColSums.data(), pc.nCols, nCols, output.ptr<float>( y ) + x0 );
+			}
+		}
+	}
+}
+
+// Running max of half width w over pSrc[0, n), with everything outside
+// treated as -inf (cv::dilate's default border). This is van Herk/Gil-
+// Werman: split the padded row into blocks of 2w + 1, take prefix and
+// suffix maxima within each block, and every window is then the max of
+// one suffix and one prefix - ~3 comparisons per pixel for any width
+static void runningMax( const float * pSrc, const int n, const int w, float * pScratch, float * pDst )
+{
+	if ( w == 0 )
+	{
+		std::copy( pSrc, pSrc + n, pDst );
+		return;
+	}
+
+	const int k = 2 * w + 1;
+	const int m = n + 2 * w;
+	float * pPad = pScratch;
+	float * pPrefix = pPad + m;
+	float * pSuffix = pPrefix + m;
+
+	std::fill( pPad, pPad + w, -FLT_MAX );
+	std::copy( pSrc, pSrc + n, pPad + w );
+	std::fill( pPad + w + n, pPad + m, -FLT_MAX );
+
+	for ( int b = 0; b < m; b += k )
+	{
+		const int e = std::min( m, b + k );
+		pPrefix[b] = pPad[b];
+		for ( int j = b + 1; j < e; j++ )
+			pPrefix[j] = std::max( pPrefix[j - 1], pPad[j] );
+		pSuffix[e - 1] = pPad[e - 1];
+		for ( int j = e - 2; j >= b; j-- )
+			pSuffix[j] = std::max( pSuffix[j + 1], pPad[j] );
+	}
+
+	// Window for x is padded [x, x + 2w]
+#pragma omp simd
+	for ( int x = 0; x < n; x++ )
+		pDst[x] = std::max( pSuffix[x], pPrefix[x + 2 * w] );
+}
+
+// The dilation element is a MORPH_ELLIPSE disk. We split it into bands of
+// rows (by distance from the center row) that share a half width; for each
+// band we take the vertical max over its rows and then one running max
+// across its width. Each band costs its row count plus ~3 comparisons per
+// pixel, so the whole disk is ~2r + 3 * (# of distinct widths) instead of
+// one comparison per element of the (2r+1)^2 mask
+struct DiskMaxKernel
+{
+	struct Band
+	{
+		int nHalfWidth;
+		int nRowMin;
+		int nRowMax;
+	};
+	int nRadius;
+	std::vector<Band> vBands;
+
+	// Scratch rows, one set per thread
+	struct Buffers
+	{
+		std::vector<float> vBand;
+		std::vector<float> vRunMax;
+		std::vector<float> vScratch;
+	};
+
+	DiskMaxKernel( const int nDiskRadius ) :
+		nRadius( nDiskRadius )
+	{
+		std::vector<int> vHalfWidths = GetEllipseHalfWidths( nRadius );
+		for ( int dy = 0; dy <= nRadius; dy++ )
+		{
+			const int nHW = vHalfWidths[nRadius + dy];
+			if ( nHW < 0 )
+				continue;
+			if ( !vBands.empty() && vBands.back().nHalfWidth == nHW && vBands.back().nRowMax == dy - 1 )
+				vBands.back().nRowMax = dy;
+			else
+				vBands.push_back( { nHW, dy, dy } );
+		}
+	}
+
+	// Dilate row y of an nRows x nCols image for columns [x0, x1), where
+	// fnRow( r ) returns image row r. Everything outside the image (or
+	// outside [0, nCols), for a sub image that reaches past the disk
+	// around [x0, x1)) is ignored. Writes x1 - x0 values to pOut
+	template <typename RowFn>
+	void MaxRow( RowFn fnRow, const int y, const int nRows, const int nCols, const int x0, const int x1, Buffers& B, float * pOut ) const
+	{
+		B.vBand.resize( nCols );
+		B.vRunMax.resize( nCols );
+		B.vScratch.resize( 3 * ( nCols + 2 * nRadius ) );
+		std::fill( pOut, pOut + ( x1 - x0 ), -FLT_MAX );
+
+		for ( const Band& band : vBands )
+		{
+			// Columns this band's running max reads from
+			const int w = band.nHalfWidth;
+			const int cx0 = std::max( 0, x0 - w );
+			const int cx1 = std::min( nCols, x1 + w );
+
+			// Vertical max over the band's rows (above and below y)
+			float * pBand = B.vBand.data();
+			bool bAny = false;
+			auto accumulate = [&]( const int r )
+			{
+				if ( r < 0 || r >= nRows )
+					return;
+				const float * pRow = fnRow( r );
+				if ( !bAny )
+				{
+					std::copy( pRow + cx0, pRow + cx1, pBand + cx0 );
+				}
+				else
+				{
+#pragma omp simd
+					for ( int x = cx0; x < cx1; x++ )
+						pBand[x] = std::max( pBand[x], pRow[x] );
+				}
+				bAny = true;
+			};
+			for ( int r = y - band.nRowMax; r <= y - band.nRowMin; r++ )
+				accumulate( r );
+			for ( int r = std::max( y + 1, y + band.nRowMin ); r <= y + band.nRowMax; r++ )
+				accumulate( r );
+			if ( !bAny )
+				continue;
+
+			// Running max across the band's width
+			float * pRunMax = B.vRunMax.data();
+			runningMax( pBand + cx0, cx1 - cx0, w, B.vScratch.data(), pRunMax );
+			pRunMax += x0 - cx0;
+#pragma omp simd
+			for ( int x = 0; x < x1 - x0; x++ )
+				pOut[x] = std::max( pOut[x], pRunMax[x] );
+		}
+	}
+};
+
+void DiskMaxFilter( const int nRadius, const cv::Mat& input, cv::Mat& output )
+{
+	if ( input.empty() || input.type() != CV_32F )
+		throw std::runtime_error( "Error: DiskMaxFilter needs a float image!" );
+
+	// We read rows around the one we write, so don't work in place
+	cv::Mat src = input.data == output.data ? input.clone() : input;
+	output.create( src.size(), CV_32F );
+
+	const DiskMaxKernel disk( nRadius );
+	auto fnRow = [&src]( const int r )
+	{
+		return src.ptr<float>( r );
+	};
+
+	const int nTilesX = ( src.cols + kTileCols - 1 ) / kTileCols;
+	const int nTilesY = ( src.rows + kTileRows - 1 ) / kTileRows;
+	const int nTiles = nTilesX * nTilesY;
+#pragma omp parallel
+	{
+		DiskMaxKernel::Buffers B;
+#pragma omp for schedule( dynamic )
+		for ( int t = 0; t < nTiles; t++ )
+		{
+			const int x0 = ( t % nTilesX ) * kTileCols;
+			const int y0 = ( t / nTilesX ) * kTileRows;
+			const int x1 = std::min( src.cols, x0 + kTileCols );
+			const int y1 = std::min( src.rows, y0 + kTileRows );
+			for ( int y = y0; y < y1; y++ )
+				disk.MaxRow( fnRow, y, src.rows, src.cols, x0, x1, B, output.ptr<float>( y ) + x0 );
+		}
+	}
+}
+
+// Everything a tile needs that only depends on the parameters
+struct FusedParams
+{
+	int nFilterRadius;
+	int nDilationRadius;
+	std::vector<float> vGaussKernel;	// 2 * nFilterRadius + 1 taps
+	double dSigma;
+	float fIntensityThreshold;
+	float fLogThreshold;				// log( 1 - kEPS ), see FusedStarFilter::Apply
+
+	FusedParams( const int nFilterRadius, const int nDilationRadius, const double dSigma, const float fIntensityThreshold );
+
+	bool Matches( const int nFilter, const int nDilation, const double dGaussSigma, const float fThreshold ) const
+	{
+		return nFilter == nFilterRadius && nDilation == nDilationRadius && dGaussSigma == dSigma && fThreshold == fIntensityThreshold;
+	}
+};
+
+// Scratch rows used while streaming through a tile, one set per thread
+struct FusedTileBuffers
+{
+	PaddedCols pcInput;					// Input columns the tile reads
+	std::vector<float> vGaussV;			// Vertical gaussian pass, padded
+	std::vector<float> vGauss;			// Full gaussian row
+	std::vector<float> vColSums;		// Top hat column sums
+	std::vector<float> vTopHat;			// Top hat disk means
+	std::vector<float> vPeak;			// Ring of peak rows
+	std::vector<float> vDilated;		// Dilated peak row
+	DiskMaxKernel::Buffers dilation;
+
+	// Reserve room for the largest tile so resizing never reallocates
+	void Reserve( const int nFilterRadius, const int nDilationRadius )
+	{
+		const int nPeakCols = kTileCols + 2 * nDilationRadius;
+		const int nInputCols = nPeakCols + 2 * nFilterRadius;
+		pcInput.vReflected.reserve( nInputCols );
+		vGaussV.reserve( nInputCols );
+		vGauss.reserve( nPeakCols );
+		vColSums.reserve( ( nFilterRadius + 1 ) * nInputCols );
+		vTopHat.reserve( nPeakCols );
+		vPeak.reserve( ( 2 * nDilationRadius + 1 ) * nPeakCols );
+		vDilated.reserve( nPeakCols );
+		dilation.vBand.reserve( nPeakCols );
+		dilation.vRunMax.reserve( nPeakCols );
+		dilation.vScratch.reserve( 3 * ( nPeakCols + 2 * nDilationRadius ) );
+	}
+};
+
+static void fusedTile( const cv::Mat& input, const FusedParams& P, const DiskSumKernel& diskSum, const DiskMaxKernel& diskMax, const cv::Rect rcTile, FusedTileBuffers& B, cv::Mat& output )
+{
+	const int nWidth = input.cols;
+	const int nHeight = input.rows;
+	const int rf = P.nFilterRadius;
+	const int rd = P.nDilationRadius;
+
+	// We need the peak image out to the dilation radius around the tile
+	const int px0 = std::max( 0, rcTile.x - rd );
+	const int px1 = std::min( nWidth, rcTile.x + rcTile.width + rd );
+	const int py0 = std::max( 0, rcTile.y - rd );
+	const int py1 = std::min( nHeight, rcTile.y + rcTile.height + rd );
+	const int nPeakCols = px1 - px0;
+	const int nPeakRows = 2 * rd + 1;
+
+	// And the input out to the filter radius around that
+	const PaddedCols& pc = B.pcInput;
+	B.pcInput.Init( px0, nPeakCols, rf, nWidth );
+	B.vGaussV.resize( pc.nCols );
+	B.vGauss.resize( nPeakCols );
+	B.vColSums.resize( ( rf + 1 ) * pc.nCols );
+	B.vTopHat.resize( nPeakCols );
+	B.vPeak.resize( nPeakRows * nPeakCols );
+	B.vDilated.resize( nPeakCols );
+
+	auto getPeakRow = [&]( const int y )
+	{
+		return &B.vPeak[( y % nPeakRows ) * nPeakCols];
+	};
+
+	// Compute gaussian - top hat, clamped at zero, for image row p
+	auto computePeakRow = [&]( const int p )
+	{
+		// Vertical gaussian pass over the in-image columns...
+		float * pGaussV = B.vGaussV.data();
+		float * pInterior = pGaussV + pc.nIn0;
+		const int nInterior = pc.nIn1 - pc.nIn0;
+		for ( int i = 0; i <= 2 * rf; i++ )
+		{
+			const float fK = P.vGaussKernel[i];
+			const float * pSrc = pc.InputRow( input, reflect101( p + i - rf, nHeight ) );
+			if ( i == 0 )
+			{
+#pragma omp simd
+				for ( int x = 0; x < nInterior; x++ )
+					pInterior[x] = fK * pSrc[x];
+			}
+			else
+			{
+#pragma omp simd
+				for ( int x = 0; x < nInterior; x++ )
+					pInterior[x] += fK * pSrc[x];
+			}
+		}
+
+		// ...which we can reflect into the padding, then the horizontal pass
+		pc.Reflect( pGaussV );
+		float * pGauss = B.vGauss.data();
+#pragma omp simd
+		for ( int x = 0; x < nPeakCols; x++ )
+			pGauss[x] = P.vGaussKernel[0] * pGaussV[x];
+		for ( int i = 1; i <= 2 * rf; i++ )
+		{
+			const float fK = P.vGaussKernel[i];
+#pragma omp simd
+			for ( int x = 0; x < nPeakCols; x++ )
+				pGauss[x] += fK * pGaussV[x + i];
+		}
+
+		// Top hat disk mean
+		float * pTopHat = B.vTopHat.data();
+		diskSum.ColumnSums( input, p, pc, B.vColSums.data() );
+		diskSum.MeanRow( B.vColSums.data(), pc.nCols, nPeakCols, pTopHat );
+
+		// Subtract and drop negative values
+		float * pPeak = getPeakRow( p );
+#pragma omp simd
+		for ( int x = 0; x < nPeakCols; x++ )
+		{
+			const float fPeak = pGauss[x] - pTopHat[x];
+			pPeak[x] = fPeak > 0 ? fPeak : 0;
+		}
+	};
+
+	// Dilate the peak image at image row y and find the local maxima
+	const int lx0 = rcTile.x - px0;
+	const int lx1 = lx0 + rcTile.width;
+	auto computeOutputRow = [&]( const int y )
+	{
+		// Rows in the ring are local columns of the peak region, which
+		// reaches past the dilation disk wherever it isn't clipped
+		float * pDilated = B.vDilated.data() + lx0;
+		diskMax.MaxRow( getPeakRow, y, nHeight, nPeakCols, lx0, lx1, B.dilation, pDilated );
+
+		// The dilated threshold image is max( T, dilated peak ), and
+		// a pixel is a local max if peak - that is (very nearly) zero
+		const float * pPeak = getPeakRow( y );
+		uint8_t * pOut = output.ptr<uint8_t>( y ) + rcTile.x;
+		for ( int x = lx0; x < lx1; x++ )
+		{
+			const float fLocalMax = pPeak[x] - std::max( pDilated[x - lx0], P.fIntensityThreshold );
+			pOut[x - lx0] = fLocalMax > P.fLogThreshold ? 0xff : 0;
+		}
+	};
+
+	// Stream down the tile; output row y is ready once
+	// we've computed the peak row rd below it
+	const int nTileEnd = rcTile.y + rcTile.height;
+	for ( int p = py0; p < nTileEnd + rd; p++ )
+	{
+		if ( p < py1 )
+			computePeakRow( p );
+
+		const int y = p - rd;
+		if ( y >= rcTile.y && y < nTileEnd )
+			computeOutputRow( y );
+	}
+}
+
+FusedParams::FusedParams( const int nFilterRadius, const int nDilationRadius, const double dSigma, const float fIntensityThreshold ) :
+	nFilterRadius( nFilterRadius ),
+	nDilationRadius( nDilationRadius ),
+	dSigma( dSigma ),
+	fIntensityThreshold( fIntensityThreshold ),
+	// findStars exponentiates the local max image and keeps pixels above
+	// 1 - kEPS; taking the log of that threshold saves us the exp
+	fLogThreshold( (float) std::log( 1 - kEPS ) )
+{
+	// Same kernel GaussianBlur would use
+	cv::Mat hGauss = cv::getGaussianKernel( 2 * nFilterRadius + 1, dSigma, CV_32F );
+	vGaussKernel.assign( hGauss.ptr<float>(), hGauss.ptr<float>() + hGauss.total() );
+}
+
+// What the fused filter keeps between frames: the kernels for
+// the last parameters it ran with and scratch rows per thread
+struct _FusedStarFilter_impl
+{
+	std::unique_ptr<FusedParams> upParams;
+	std::unique_ptr<DiskSumKernel> upDiskSum;
+	std::unique_ptr<DiskMaxKernel> upDiskMax;
+	std::vector<FusedTileBuffers> vBuffers;
+};
+
+FusedStarFilter::FusedStarFilter() :
+	m_pImpl( new _FusedStarFilter_impl() )
+{}
+
+FusedStarFilter::~FusedStarFilter()
+{}
+
+void FusedStarFilter::Apply( const cv::Mat& input, const int nFilterRadius, const int nDilationRadius,
+							 const double dSigma, const float fIntensityThreshold, cv::Mat& imgBoolean )
+{
+	if ( input.empty() || input.type() != CV_32F )
+		throw std::runtime_error( "Error: FusedStarFilter needs a float image!" );
+
+#ifdef _OPENMP
+	const int nThreads = omp_get_max_threads();
+#else
+	const int nThreads = 1;
+#endif
+
+	// Rebuild the kernels and rereserve scratch if the parameters
+	// changed (or we're new); otherwise there's nothing to allocate
+	_FusedStarFilter_impl& S = *m_pImpl;
+	bool bReserve = false;
+	if ( !( S.upParams && S.upParams->Matches( nFilterRadius, nDilationRadius, dSigma, fIntensityThreshold ) ) )
+	{
+		S.upParams.reset( new FusedParams( nFilterRadius, nDilationRadius, dSigma, fIntensityThreshold ) );
+		S.upDiskSum.reset( new DiskSumKernel( nFilterRadius ) );
+		S.upDiskMax.reset( new DiskMaxKernel( nDilationRadius ) );
+		bReserve = true;
+	}
+	if ( (int) S.vBuffers.size() < nThreads )
+	{
+		S.vBuffers.resize( nThreads );
+		bReserve = true;
+	}
+	if ( bReserve )
+	{
+		for ( FusedTileBuffers& B : S.vBuffers )
+			B.Reserve( nFilterRadius, nDilationRadius );
+	}
+
+	imgBoolean.create( input.size(), CV_8U );
+
+	// Tiles are independent, each thread uses its own scratch rows
+	const int nTilesX = ( input.cols + kTileCols - 1 ) / kTileCols;
+	const int nTilesY = ( input.rows + kTileRows - 1 ) / kTileRows;
+	const int nTiles = nTilesX * nTilesY;
+#pragma omp parallel num_threads( nThreads )
+	{
+#ifdef _OPENMP
+		FusedTileBuffers& B = S.vBuffers[omp_get_thread_num()];
+#else
+		FusedTileBuffers& B = S.vBuffers[0];
+#endif
+#pragma omp for schedule( dynamic )
+		for ( int t = 0; t < nTiles; t++ )
+		{
+			cv::Rect rcTile;
+			rcTile.x = ( t % nTilesX ) * kTileCols;
+			rcTile.y = ( t / nTilesX ) * kTileRows;
+			rcTile.width = std::min( kTileCols, input.cols - rcTile.x );
+			rcTile.height = std::min( kTileRows, input.rows - rcTile.y );
+			fusedTile( input, *S.upParams, *S.upDiskSum, *S.upDiskMax, rcTile, B, imgBoolean );
+		}
+	}
+}
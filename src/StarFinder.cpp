@@ -1,4 +1,6 @@
 #include "StarFinder.h"
+#include "StarFilter.h"
+#include "StarRegistration.h"
 #include "FileReader.h"
 #include "Util.h"
 
@@ -19,6 +21,12 @@
 
 #include <opencv2/opencv.hpp>
 
+#include <algorithm>
+#include <cfloat>
+#include <tuple>
+#include <string.h>
+#include <stdint.h>
+
 #ifdef max
 #undef max
 #endif
@@ -28,19 +36,106 @@
 #endif
 
 // Filtering functions, defined below
-void DoGaussianFilter( const int nFilterRadius, const double dSigma, img_t& input, img_t& output );
-void DoTophatFilter( const int nFilterRadius, img_t& input, img_t& output );
-void DoDilationFilter( const int nFilterRadius, img_t& input, img_t& output );
+void DoGaussianFilter( const int nFilterRadius, const double dSigma, const img_t& input, img_t& output );
+void DoTophatFilter( const int nFilterRadius, const img_t& input, img_t& output );
+void DoDilationFilter( const int nFilterRadius, const img_t& input, img_t& output );
+
+StarFinderWorkspace::StarFinderWorkspace( const cv::Size szFrame ) :
+	szFrame( szFrame )
+{
+	// We need a contiguous boolean image for CUDA
+#if SH_CUDA
+	imgBoolean = cv::cuda::createContinuous( szFrame, CV_8U );
+#else
+	imgBoolean = img_t( szFrame, CV_8U );
+#endif
+}
 
 StarFinder::StarFinder() :
 	// These are some good defaults
 	m_fFilterRadius( .03f ),
 	m_fDilationRadius( .015f ),
 	m_fHWHM( 2.5f ),
-	m_fIntensityThreshold( 0.25f )
+	m_fIntensityThreshold( 0.25f ),
+	m_nBinning( 1 ),
+	m_bUseFusedFilter( true ),
+	m_bBorrowInput( true ),
+	m_nMaxWorkspaces( 3 ),
+	m_pWorkspace( nullptr )
 {}
 
-bool StarFinder::findStars( img_t& img )
+void StarFinder::SetBinning( const int nBinning )
+{
+	if ( nBinning < 1 )
+		throw std::runtime_error( "Error: Invalid binning factor " + std::to_string( nBinning ) );
+	m_nBinning = nBinning;
+}
+
+// Stars are about this big in unbinned pixels
+const float kStarRadius = 10.f;
+
+float StarFinder::getHWHM() const
+{
+	return m_fHWHM / m_nBinning;
+}
+
+float StarFinder::getStarRadius() const
+{
+	return kStarRadius / m_nBinning;
+}
+
+// The filter radii are capped at this many unbinned pixels
+const int kMaxFilterRadius = 15;
+
+int StarFinder::getFilterRadius( const int nCols ) const
+{
+	return std::min<int>( kMaxFilterRadius / m_nBinning, ( .5f + m_fFilterRadius * nCols ) );
+}
+
+int StarFinder::getDilationRadius( const int nCols ) const
+{
+	return std::min<int>( kMaxFilterRadius / m_nBinning, ( .5f + m_fDilationRadius * nCols ) );
+}
+
+void StarFinder::SetUseFusedFilter( bool bUseFused )
+{
+	m_bUseFusedFilter = bUseFused;
+}
+
+void StarFinder::SetBorrowInput( bool bBorrow )
+{
+	m_bBorrowInput = bBorrow;
+	if ( bBorrow )
+	{
+		for ( auto& upWorkspace : m_liWorkspaces )
+			upWorkspace->imgInput.release();
+	}
+}
+
+StarFinderWorkspace * StarFinder::getWorkspace( const cv::Size szFrame )
+{
+	// Usually it's the one we just used
+	if ( m_pWorkspace && m_pWorkspace->szFrame == szFrame )
+		return m_pWorkspace;
+
+	// Otherwise look for it and move it up front
+	auto it = std::find_if( m_liWorkspaces.begin(), m_liWorkspaces.end(),
+							[szFrame] ( const std::unique_ptr<StarFinderWorkspace>& upWorkspace ) { return upWorkspace->szFrame == szFrame; } );
+	if ( it != m_liWorkspaces.end() )
+	{
+		m_liWorkspaces.splice( m_liWorkspaces.begin(), m_liWorkspaces, it );
+		return m_liWorkspaces.front().get();
+	}
+
+	// New size - make one, dropping the least recently used if we're full
+	m_liWorkspaces.emplace_front( new StarFinderWorkspace( szFrame ) );
+	while ( m_liWorkspaces.size() > m_nMaxWorkspaces )
+		m_liWorkspaces.pop_back();
+
+	return m_liWorkspaces.front().get();
+}
+
+bool StarFinder::findStars( const img_t& img )
 {
 	if ( img.empty() )
 		return false;
@@ -49,79 +144,75 @@ bool StarFinder::findStars( img_t& img )
 	if ( img.type() != CV_32F )
 		throw std::runtime_error( "Error: What kind of image is StarFinder working with?!" );
 
-	// Initialize if we haven't yet
-	if ( m_imgInput.empty() )
+	// Get buffers for this frame size
+	m_pWorkspace = getWorkspace( img.size() );
+	StarFinderWorkspace& W = *m_pWorkspace;
+
+	// Every stage writes to its own buffer, so we can read the
+	// caller's image directly (HandleImage only borrows it). If
+	// we were asked not to, copy it into our own input buffer
+	if ( !m_bBorrowInput )
+		img.copyTo( W.imgInput );
+	const img_t& imgInput = m_bBorrowInput ? img : W.imgInput;
+
+	int nFilterRadius = getFilterRadius( imgInput.cols );
+	int nDilationRadius = getDilationRadius( imgInput.cols );
+
+	const double dSigma = getHWHM() / ( ( sqrt( 2 * log( 2 ) ) ) );
+
+#if !SH_CUDA
+	// The fused filter leaves the same boolean image without
+	// streaming the whole frame through memory at every stage
+	if ( m_bUseFusedFilter )
 	{
-		// Preallocate the GPU mats needed during computation
-		m_imgGaussian = img_t( img.size(), CV_32F );
-		m_imgTopHat = img_t( img.size(), CV_32F );
-		m_imgPeak = img_t( img.size(), CV_32F );
-		m_imgThreshold = img_t( img.size(), CV_32F );
-		m_imgDilated = img_t( img.size(), CV_32F );
-		m_imgLocalMax = img_t( img.size(), CV_32F );
-		m_imgStars = img_t( img.size(), CV_32F );
-
-		// We need a contiguous boolean image for CUDA
-#if SH_CUDA
-		m_imgBoolean = cv::cuda::createContinuous( img.size(), CV_8U );
-#else
-		m_imgBoolean = img_t( img.size(), CV_8U );
-#endif
+		W.fusedFilter.Apply( imgInput, nFilterRadius, nDilationRadius, dSigma, m_fIntensityThreshold, W.imgBoolean );
+		return true;
 	}
-	
-	// Work with copy of original
-	m_imgInput = img.clone();
-
-	// I think I can just steal the reference
-//	// Upload input to GPU for CUDA
-//#if SH_CUDA
-//    m_imgInput.upload( img );
-//#else
-//    m_imgInput = img.clone();
-//#endif
+#endif
 
-	int nFilterRadius = std::min<int>( 15, ( .5f + m_fFilterRadius * m_imgInput.cols ) );
-	int nDilationRadius = std::min<int>( 15, ( .5f + m_fDilationRadius * m_imgInput.cols ) );
+	// Make the stage images if this is the first time
+	// we've run the chain at this size (no-op otherwise)
+	for ( img_t * pImg : { &W.imgGaussian, &W.imgTopHat, &W.imgPeak, &W.imgThreshold, &W.imgDilated, &W.imgLocalMax, &W.imgStars } )
+		pImg->create( W.szFrame, CV_32F );
 
 	// Apply gaussian filter to input to remove high frequency noise
-	const double dSigma = m_fHWHM / ( ( sqrt( 2 * log( 2 ) ) ) );
-	DoGaussianFilter( nFilterRadius, dSigma, m_imgInput, m_imgGaussian );
+	DoGaussianFilter( nFilterRadius, dSigma, imgInput, W.imgGaussian );
 
 	// Apply linear filter to input to magnify high frequency noise
-	DoTophatFilter( nFilterRadius, m_imgInput, m_imgTopHat );
+	DoTophatFilter( nFilterRadius, imgInput, W.imgTopHat );
 
 	// Subtract linear filtered image from gaussian image to clean area around peak
 	// Noisy areas around the peak will be negative, so threshold negative values to zero
-	::subtract( m_imgGaussian, m_imgTopHat, m_imgPeak );
-	::threshold( m_imgPeak, m_imgPeak, 0, 1, cv::THRESH_TOZERO );
+	::subtract( W.imgGaussian, W.imgTopHat, W.imgPeak );
+	::threshold( W.imgPeak, W.imgPeak, 0, 1, cv::THRESH_TOZERO );
 
 	// Create a thresholded image where the lowest pixel value is m_fIntensityThreshold
-	m_imgThreshold.setTo( cv::Scalar( m_fIntensityThreshold ) );
-	::max( m_imgPeak, m_imgThreshold, m_imgThreshold );
+	W.imgThreshold.setTo( cv::Scalar( m_fIntensityThreshold ) );
+	::max( W.imgPeak, W.imgThreshold, W.imgThreshold );
 
 	// Create the dilated image (initialize its pixels to m_fIntensityThreshold)
-	m_imgDilated.setTo( cv::Scalar( m_fIntensityThreshold ) );
+	W.imgDilated.setTo( cv::Scalar( m_fIntensityThreshold ) );
 
-	DoDilationFilter( nDilationRadius, m_imgThreshold, m_imgDilated );
+	DoDilationFilter( nDilationRadius, W.imgThreshold, W.imgDilated );
 
 	// Subtract the dilated image from the gaussian peak image
 	// What this leaves us with is an image where the brightest
 	// gaussian peak pixels are zero and all others are negative
-	::subtract( m_imgPeak, m_imgDilated, m_imgLocalMax );
+	::subtract( W.imgPeak, W.imgDilated, W.imgLocalMax );
 
 	// Exponentiating that image makes those zero pixels 1, and the
 	// negative pixels some low number; threshold to drop them
-	::exp( m_imgLocalMax, m_imgLocalMax );
-	::threshold( m_imgLocalMax, m_imgStars, 1 - kEPS, 1 + kEPS, cv::THRESH_BINARY );
+	::exp( W.imgLocalMax, W.imgLocalMax );
+	::threshold( W.imgLocalMax, W.imgStars, 1 - kEPS, 1 + kEPS, cv::THRESH_BINARY );
 
 	// This star image is now a boolean image - convert it to bytes (TODO you should add some noise)
-	m_imgStars.convertTo( m_imgBoolean, CV_8U, 0xff );
+	W.imgStars.convertTo( W.imgBoolean, CV_8U, 0xff );
 
 	return true;
 }
 
 // Just find the stars
-bool StarFinder::HandleImage( img_t img )
+bool StarFinder::HandleImage( const img_t& img )
 {
 	return findStars( img );
 }
@@ -130,7 +221,7 @@ StarFinder_UI::StarFinder_UI() :
 	StarFinder()
 {}
 
-bool StarFinder_UI::HandleImage( img_t img )
+bool StarFinder_UI::HandleImage( const img_t& img )
 {
 	// Call this once to test input and init images
 	if ( !findStars( img ) )
@@ -165,8 +256,7 @@ bool StarFinder_UI::HandleImage( img_t img )
 			throw std::runtime_error( "Error! Why did findStars return false?" );
 
 		// Use thrust to find stars in pixel coordinates
-		const float fStarRadius = 10.f;
-		std::vector<Circle> vStarLocations = FindStarsInImage( fStarRadius, m_imgBoolean );
+		std::vector<Circle> vStarLocations = FindStarsInImage( getStarRadius(), m_pWorkspace->imgBoolean );
 
 		// Create copy of original input and draw circles where stars were found
 #if SH_CUDA
@@ -212,55 +302,89 @@ StarFinder_Drift::StarFinder_Drift() :
 	m_fDriftY_Cumulative( 0 )
 {}
 
-bool StarFinder_Drift::HandleImage( img_t img )
+// Sorts stars by the image value at their centers, brightest
+// first, which is the order StarRegistration wants them in
+static void sortByBrightness( const cv::Mat& img, std::vector<Circle>& vStars )
+{
+	auto brightness = [&img] ( const Circle c )
+	{
+		const int x = std::min( std::max( (int) ( c.fX + .5f ), 0 ), img.cols - 1 );
+		const int y = std::min( std::max( (int) ( c.fY + .5f ), 0 ), img.rows - 1 );
+		return img.at<float>( y, x );
+	};
+	std::stable_sort( vStars.begin(), vStars.end(), [&brightness] ( const Circle a, const Circle b ) { return brightness( a ) > brightness( b ); } );
+}
+
+std::vector<Circle> StarFinder::locateStars( const cv::Mat& hImg )
+{
+	// Use thrust to find stars in pixel coordinates, then
+	// centroid them in the image to get sub-pixel positions
+	std::vector<Circle> vStarLocations = FindStarsInImage( getStarRadius(), m_pWorkspace->imgBoolean );
+	RefineCentroids( hImg, (int) ceil( 2 * getHWHM() ) + 1, vStarLocations );
+	sortByBrightness( hImg, vStarLocations );
+	return vStarLocations;
+}
+
+bool StarFinder_Drift::HandleImage( const img_t& img )
 {
 	if ( !findStars( img ) )
 		return false;
 
+	// Star positions are refined and ranked on the host
+#if SH_CUDA
+	cv::Mat hImg;
+	img.download( hImg );
+#else
+	const cv::Mat& hImg = img;
+#endif
+
+	std::vector<Circle> vStarLocations = locateStars( hImg );
+
 	if ( m_vLastCircles.empty() )
 	{
 		// Store if not yet created
-		const float fStarRadius = 10.f;
-		m_vLastCircles = FindStarsInImage( fStarRadius, m_imgBoolean );
+		m_vLastCircles = vStarLocations;
 	}
 	else
 	{
-		// Use thrust to find stars in pixel coordinates
-		std::vector<Circle> vStarLocations = FindStarsInImage( 10, m_imgBoolean );
-
 		// If these are sized different, we have problems
 		//if ( vStarLocations.size() != m_vLastCircles.size() )
 		//	throw std::runtime_error( "We lost some stars" );
 
-		// Compute the average drift for this set of matches
-		float fDriftAvgX = 0;
-		float fDriftAvgY = 0;
+		// Match stars that overlap their old positions
+		std::vector<std::pair<int, int>> vMatches = MatchStars( m_vLastCircles, vStarLocations );
 
-		// For every circle in our last vector
-		for ( const Circle cOld : m_vLastCircles )
+		// If most of them didn't, the field probably jumped further than
+		// a star radius (a slew, or the wind). Register the two fields and
+		// match again with the old stars moved to where they should be now
+		const size_t nMinMatches = std::max<size_t>( 3, std::min( m_vLastCircles.size(), vStarLocations.size() ) / 2 );
+		if ( vMatches.size() < nMinMatches )
 		{
-			// Try to find a match in this vector
-			bool bMatchFound = false;
-			for ( const Circle cNew : vStarLocations )
+			StarTransform xf;
+			if ( StarRegistration( m_vLastCircles ).Register( vStarLocations, &xf ) )
 			{
-				// We've come full circle...
-				if ( bMatchFound )
-					break;
-
-				// Compute the drift between old and new
-				float fDistX = cNew.fX - cOld.fX;
-				float fDistY = cNew.fY - cOld.fY;
-				float fDist2 = pow( fDistX, 2 ) + pow( fDistY, 2 );
-				if ( fDist2 < pow( cOld.fR + cNew.fR, 2 ) )
-				{
-					// Divide this drift by the # of stars we have to average
-					fDriftAvgX += fDistX / float( m_vLastCircles.size() );
-					fDriftAvgY += fDistY / float( m_vLastCircles.size() );
-					bMatchFound = true;
-				}
+				std::vector<Circle> vMoved;
+				vMoved.reserve( m_vLastCircles.size() );
+				for ( const Circle c : m_vLastCircles )
+					vMoved.push_back( xf.Apply( c ) );
+
+				std::vector<std::pair<int, int>> vRegisteredMatches = MatchStars( vMoved, vStarLocations );
+				if ( vRegisteredMatches.size() > vMatches.size() )
+					vMatches = std::move( vRegisteredMatches );
 			}
 		}
 
+		// Compute the average drift over the stars we could match
+		float fDriftAvgX = 0;
+		float fDriftAvgY = 0;
+		for ( const std::pair<int, int>& match : vMatches )
+		{
+			const Circle cOld = m_vLastCircles[match.first];
+			const Circle cNew = vStarLocations[match.second];
+			fDriftAvgX += ( cNew.fX - cOld.fX ) / float( vMatches.size() );
+			fDriftAvgY += ( cNew.fY - cOld.fY ) / float( vMatches.size() );
+		}
+
 		// Update cached positions, inc cumulative drift counter
 		m_vLastCircles = vStarLocations;
 		m_fDriftX_Prev = fDriftAvgX;
@@ -317,7 +441,7 @@ StarFinder_ImgOffset::StarFinder_ImgOffset( FileReader_WithDrift * pFileReader )
 	m_pFileReader( pFileReader )
 {}
 
-bool StarFinder_ImgOffset::HandleImage( img_t img )
+bool StarFinder_ImgOffset::HandleImage( const img_t& img )
 {
 	// displayImage( "Offset", img );
 
@@ -332,9 +456,7 @@ bool StarFinder_ImgOffset::HandleImage( img_t img )
 			if ( GetDrift_Prev( &fDriftX, &fDriftY ) )
 			{
 				// Increment drift of FR velocity by current amount
-				int nDriftX = (int) fDriftX;
-				int nDriftY = (int) fDriftY;
-				m_pFileReader->IncDriftVel( -nDriftX, nDriftY );
+				m_pFileReader->IncDriftVel( -fDriftX, fDriftY );
 			}
 		}
 
@@ -365,6 +487,11 @@ bool StarHunter::Run()
 		// Declare slew cmd counter (set to limit 
 		int nImagesTillSlewCMD( m_nImagesPerSlewCMD );
 
+		// How long we block waiting for the camera each loop; the
+		// camera wakes us when a frame arrives, this just keeps
+		// the window and input responsive while it doesn't
+		const std::chrono::milliseconds tFrameWait( 16 );
+
 		// Detect, then calibrate, then track, then get out
 		for ( m_eState = State::NONE; m_eState != State::DONE;)
 		{
@@ -399,12 +526,12 @@ bool StarHunter::Run()
 					m_eState = State::DETECT;
 					break;
 
-					// During the detect phase, we call GetNextImage on the camera
+					// During the detect phase, we call WaitForNextImage on the camera
 					// and send it to the star finder. Eventually the sf will get
 					// a drift value, at which point we start calibrating
 				case State::DETECT:
 					// Get an image from the camera
-					eImgStat = m_upCamera->GetNextImage( &img );
+					eImgStat = m_upCamera->WaitForNextImage( &img, tFrameWait );
 					if ( eImgStat == ImageSource::Status::READY )
 						m_upStarFinder->HandleImage( img );
 					else
@@ -426,7 +553,7 @@ bool StarHunter::Run()
 					// telescope mount until the drift values go below some threshold
 				case State::CALIBRATE:
 					// Get an image from the camera
-					eImgStat = m_upCamera->GetNextImage( &img );
+					eImgStat = m_upCamera->WaitForNextImage( &img, tFrameWait );
 					if ( eImgStat == ImageSource::Status::READY )
 						m_upStarFinder->HandleImage( img );
 					else
@@ -477,7 +604,7 @@ bool StarHunter::Run()
 					// making the camera take images and storing them
 				case State::TRACK:
 					// This will return DONE when the camera is out of images
-					if ( m_upCamera->GetNextImage( &img ) == ImageSource::Status::DONE )
+					if ( m_upCamera->WaitForNextImage( &img, tFrameWait ) == ImageSource::Status::DONE )
 					{
 						m_eState = State::DONE;
 						m_upCamera->SetMode( SHCamera::Mode::Off );
@@ -537,7 +664,7 @@ void displayImage( std::string strWindowName, cv::cuda::GpuMat& img )
 	cv::destroyWindow( strWindowName );
 }
 
-void DoTophatFilter( const int nFilterRadius, img_t& input, img_t& output )
+void DoTophatFilter( const int nFilterRadius, const img_t& input, img_t& output )
 {
 	int nDiameter = 2 * nFilterRadius + 1;
 	cv::Mat h_Circle = cv::Mat::zeros( cv::Size( nDiameter, nDiameter ), CV_32F );
@@ -547,14 +674,14 @@ void DoTophatFilter( const int nFilterRadius, img_t& input, img_t& output )
 	pLinCircFilter->apply( input, output );
 }
 
-void DoGaussianFilter( const int nFilterRadius, const double dSigma, img_t& input, img_t& output )
+void DoGaussianFilter( const int nFilterRadius, const double dSigma, const img_t& input, img_t& output )
 {
 	int nDiameter = 2 * nFilterRadius + 1;
 	cv::Ptr<cv::cuda::Filter> pGaussFilter = cv::cuda::createGaussianFilter( CV_32F, CV_32F, cv::Size( nDiameter, nDiameter ), dSigma );
 	pGaussFilter->apply( input, output );
 }
 
-void DoDilationFilter( const int nFilterRadius, img_t& input, img_t& output )
+void DoDilationFilter( const int nFilterRadius, const img_t& input, img_t& output )
 {
 	int nDilationDiameter = 2 * nFilterRadius + 1;
 	cv::Mat hDilationStructuringElement = cv::getStructuringElement( cv::MORPH_ELLIPSE, cv::Size( nDilationDiameter, nDilationDiameter ) );
@@ -562,123 +689,508 @@ void DoDilationFilter( const int nFilterRadius, img_t& input, img_t& output )
 	pDilation->apply( input, output );
 }
 #else
-void DoTophatFilter( const int nFilterRadius, img_t& input, img_t& output )
+void DoTophatFilter( const int nFilterRadius, const img_t& input, img_t& output )
 {
-	int nDiameter = 2 * nFilterRadius + 1;
-	cv::Mat h_Circle = cv::Mat::zeros( cv::Size( nDiameter, nDiameter ), CV_32F );
-	cv::circle( h_Circle, cv::Size( nFilterRadius, nFilterRadius ), nFilterRadius, 1.f, -1 );
-	h_Circle /= cv::sum( h_Circle )[0];
-	cv::filter2D( input, output, CV_32F, h_Circle );
+	// Same normalized disk as above, without the (2r+1)^2 kernel
+	DiskMeanFilter( nFilterRadius, input, output );
 }
 
-void DoGaussianFilter( const int nFilterRadius, const double dSigma, img_t& input, img_t& output )
+void DoGaussianFilter( const int nFilterRadius, const double dSigma, const img_t& input, img_t& output )
 {
 	int nDiameter = 2 * nFilterRadius + 1;
 	cv::GaussianBlur( input, output, cv::Size( nDiameter, nDiameter ), dSigma );
 }
 
-void DoDilationFilter( const int nFilterRadius, img_t& input, img_t& output )
+void DoDilationFilter( const int nFilterRadius, const img_t& input, img_t& output )
 {
-	int nDilationDiameter = 2 * nFilterRadius + 1;
-	cv::Mat hDilationStructuringElement = cv::getStructuringElement( cv::MORPH_ELLIPSE, cv::Size( nDilationDiameter, nDilationDiameter ) );
-	cv::dilate( input, output, hDilationStructuringElement );
+	// Same elliptical element as above, but the cost doesn't scale with its area
+	DiskMaxFilter( nFilterRadius, input, output );
 }
 #endif
 
+// Smallest circle containing both circles
+static Circle unionCircle( const Circle cA, const Circle cB )
+{
+	// Compute distance from A to B
+	float fDistX = cB.fX - cA.fX;
+	float fDistY = cB.fY - cA.fY;
+	float fDist = sqrt( fDistX * fDistX + fDistY * fDistY );
+
+	// If one is inside the other (or they coincide) that's it
+	if ( fDist + cB.fR <= cA.fR )
+		return cA;
+	if ( fDist + cA.fR <= cB.fR )
+		return cB;
+
+	// Compute unit vector from A to B
+	float nX = fDistX / fDist;
+	float nY = fDistY / fDist;
+
+	// Find furthest points on both circles
+	float x0 = cA.fX - nX * cA.fR;
+	float y0 = cA.fY - nY * cA.fR;
+	float x1 = cB.fX + nX * cB.fR;
+	float y1 = cB.fY + nY * cB.fR;
+
+	// The distance between these points is the diameter of the union
+	// circle, and the center is the midpoint between the furthest points
+	Circle cUnion { 0 };
+	cUnion.fR = ( fDist + cA.fR + cB.fR ) / 2;
+	cUnion.fX = ( x0 + x1 ) / 2;
+	cUnion.fY = ( y0 + y1 ) / 2;
+	return cUnion;
+}
+
+// Circles sorted into square grid cells, so we can find the
+// ones near a point without looking at every one of them
+class CircleGrid
+{
+	struct Cell
+	{
+		int64_t nCellX;
+		int64_t nCellY;
+		int nIdx;
+
+		bool operator<( const Cell& other ) const
+		{
+			return std::tie( nCellX, nCellY, nIdx ) < std::tie( other.nCellX, other.nCellY, other.nIdx );
+		}
+	};
+
+	float m_fCellSize;
+	std::vector<Cell> m_vCells;
+
+	Cell cellOf( const float fX, const float fY, const int nIdx ) const
+	{
+		return { (int64_t) floor( fX / m_fCellSize ), (int64_t) floor( fY / m_fCellSize ), nIdx };
+	}
+
+public:
+	CircleGrid( const std::vector<Circle>& vCircles, const float fCellSize ) :
+		m_fCellSize( std::max( fCellSize, 1.f ) )
+	{
+		m_vCells.reserve( vCircles.size() );
+		for ( int i = 0; i < (int) vCircles.size(); i++ )
+			m_vCells.push_back( cellOf( vCircles[i].fX, vCircles[i].fY, i ) );
+		std::sort( m_vCells.begin(), m_vCells.end() );
+	}
+
+	// Calls fnVisit( idx ) for the circles in the cells around ( fX, fY ) with
+	// an index greater than nAfterIdx, which covers every circle whose
+	// center is within a cell size of the point
+	template <typename Fn>
+	void ForEachNear( const float fX, const float fY, Fn fnVisit, const int nAfterIdx = -1 ) const
+	{
+		const Cell center = cellOf( fX, fY, nAfterIdx );
+		for ( int64_t nCellY = center.nCellY - 1; nCellY <= center.nCellY + 1; nCellY++ )
+		{
+			for ( int64_t nCellX = center.nCellX - 1; nCellX <= center.nCellX + 1; nCellX++ )
+			{
+				auto it = std::upper_bound( m_vCells.begin(), m_vCells.end(), Cell { nCellX, nCellY, nAfterIdx } );
+				for ( ; it != m_vCells.end() && it->nCellX == nCellX && it->nCellY == nCellY; ++it )
+					fnVisit( it->nIdx );
+			}
+		}
+	}
+};
+
+static int findRoot( std::vector<int>& vParent, int i )
+{
+	while ( vParent[i] != i )
+	{
+		// Path halving
+		vParent[i] = vParent[vParent[i]];
+		i = vParent[i];
+	}
+	return i;
+}
+
 // Collapse a vector of potentiall overlapping circles
 // into a vector of non-overlapping circles
 std::vector<Circle> CollapseCircles( const std::vector<Circle>& vInput )
 {
-	std::vector<Circle> vRet;
+	std::vector<Circle> vRet = vInput;
 
-	for ( const Circle cInput : vInput )
+	// Union circles can overlap circles their parts didn't,
+	// so keep going until a pass doesn't collapse anything
+	for ( size_t nPrevSize = 0; vRet.size() > 1 && vRet.size() != nPrevSize; )
 	{
-		bool bMatchFound = false;
-		for ( Circle& cMatch : vRet )
+		const int nCircles = (int) vRet.size();
+		nPrevSize = vRet.size();
+
+		// Put circles in a grid with cells as wide as the biggest circle,
+		// so overlapping circles are never more than a cell apart
+		float fMaxR = 0;
+		for ( const Circle c : vRet )
+			fMaxR = std::max( fMaxR, c.fR );
+		const CircleGrid grid( vRet, 2 * fMaxR );
+
+		// Join every circle with the later circles it overlaps
+		// The first circle of a group is its root, so the output keeps input order
+		std::vector<int> vParent( nCircles );
+		for ( int i = 0; i < nCircles; i++ )
+			vParent[i] = i;
+
+		for ( int i = 0; i < nCircles; i++ )
 		{
-			// Compute distance from input to match
-			float fDistX = cMatch.fX - cInput.fX;
-			float fDistY = cMatch.fY - cInput.fY;
-			float fDist2 = pow( fDistX, 2 ) + pow( fDistY, 2 );
-			if ( fDist2 < pow( cInput.fR + cMatch.fR, 2 ) )
+			const Circle cA = vRet[i];
+			grid.ForEachNear( cA.fX, cA.fY, [&] ( const int j )
 			{
-				// Skip if they're very close
-				if ( fDist2 < kEPS )
-				{
-					bMatchFound = true;
-					continue;
-				}
+				const Circle cB = vRet[j];
+				float fDistX = cB.fX - cA.fX;
+				float fDistY = cB.fY - cA.fY;
+				if ( fDistX * fDistX + fDistY * fDistY >= pow( cA.fR + cB.fR, 2 ) )
+					return;
+
+				int nRootA = findRoot( vParent, i );
+				int nRootB = findRoot( vParent, j );
+				vParent[std::max( nRootA, nRootB )] = std::min( nRootA, nRootB );
+			}, i );
+		}
 
-				// Compute union circle
-				Circle cUnion { 0 };
+		// Replace each group with the circle containing all of it
+		std::vector<Circle> vCollapsed;
+		std::vector<int> vCollapsedIdx( nCircles );
+		for ( int i = 0; i < nCircles; i++ )
+		{
+			const int nRoot = findRoot( vParent, i );
+			if ( nRoot == i )
+			{
+				vCollapsedIdx[i] = (int) vCollapsed.size();
+				vCollapsed.push_back( vRet[i] );
+			}
+			else
+			{
+				vCollapsedIdx[i] = vCollapsedIdx[nRoot];
+				Circle& cUnion = vCollapsed[vCollapsedIdx[i]];
+				cUnion = unionCircle( cUnion, vRet[i] );
+			}
+		}
 
-				// Compute unit vector from input to match
-				float fDist = sqrt( fDist2 );
-				float nX = fDistX / fDist;
-				float nY = fDistY / fDist;
+		vRet = std::move( vCollapsed );
+	}
 
-				// Find furthest points on both circles
-				float x0 = cInput.fX - nX * cInput.fR;
-				float y0 = cInput.fY - nY * cInput.fR;
-				float x1 = cMatch.fX + nX * cMatch.fR;
-				float y1 = cMatch.fY + nY * cMatch.fR;
+	return vRet;
+}
 
-				// The distance between these points is the diameter of the union circle
-				float fUnionDiameter = sqrt( pow( x1 - x0, 2 ) + pow( y1 - y0, 2 ) );
-				cUnion.fR = fUnionDiameter / 2;
+// For each circle in vFrom, the nearest circle in vTo that overlaps it (or -1)
+static std::vector<int> nearestOverlapping( const std::vector<Circle>& vFrom, const std::vector<Circle>& vTo )
+{
+	float fMaxR_From = 0, fMaxR_To = 0;
+	for ( const Circle c : vFrom )
+		fMaxR_From = std::max( fMaxR_From, c.fR );
+	for ( const Circle c : vTo )
+		fMaxR_To = std::max( fMaxR_To, c.fR );
+	const CircleGrid grid( vTo, fMaxR_From + fMaxR_To );
+
+	std::vector<int> vNearest( vFrom.size(), -1 );
+	for ( int i = 0; i < (int) vFrom.size(); i++ )
+	{
+		const Circle cFrom = vFrom[i];
+		float fBestDist2 = FLT_MAX;
+		grid.ForEachNear( cFrom.fX, cFrom.fY, [&] ( const int j )
+		{
+			const Circle cTo = vTo[j];
+			float fDistX = cTo.fX - cFrom.fX;
+			float fDistY = cTo.fY - cFrom.fY;
+			float fDist2 = fDistX * fDistX + fDistY * fDistY;
+			if ( fDist2 < pow( cFrom.fR + cTo.fR, 2 ) && fDist2 < fBestDist2 )
+			{
+				fBestDist2 = fDist2;
+				vNearest[i] = j;
+			}
+		} );
+	}
+
+	return vNearest;
+}
+
+std::vector<std::pair<int, int>> MatchStars( const std::vector<Circle>& vOld, const std::vector<Circle>& vNew )
+{
+	// Only keep pairs that pick each other, so one
+	// new star can't be the match for several old ones
+	std::vector<int> vOldToNew = nearestOverlapping( vOld, vNew );
+	std::vector<int> vNewToOld = nearestOverlapping( vNew, vOld );
+
+	std::vector<std::pair<int, int>> vMatches;
+	for ( int i = 0; i < (int) vOld.size(); i++ )
+	{
+		const int j = vOldToNew[i];
+		if ( j >= 0 && vNewToOld[j] == i )
+			vMatches.emplace_back( i, j );
+	}
+
+	return vMatches;
+}
+
+void RefineCentroids( const cv::Mat& img, const int nRadius, std::vector<Circle>& vStars )
+{
+	if ( img.type() != CV_32F || img.empty() )
+		throw std::runtime_error( "Error: Stars must be centroided in float images!" );
+
+	// Half width of each row of the disk we centroid over
+	std::vector<int> vHalfWidths( 2 * nRadius + 1 );
+	for ( int dy = -nRadius; dy <= nRadius; dy++ )
+		vHalfWidths[dy + nRadius] = (int) sqrt( float( nRadius * nRadius - dy * dy ) );
 
-				// And the center is the midpoint between the furthest points
-				cUnion.fX = ( x0 + x1 ) / 2;
-				cUnion.fY = ( y0 + y1 ) / 2;
+#pragma omp parallel for schedule( dynamic, 16 )
+	for ( int s = 0; s < (int) vStars.size(); s++ )
+	{
+		Circle& cStar = vStars[s];
 
-				// Replace this circle with the union circle
-				cMatch = cUnion;
-				bMatchFound = true;
+		// Recenter a few times in case the first window was off
+		for ( int nIter = 0; nIter < 3; nIter++ )
+		{
+			const int cx = (int) std::lround( cStar.fX );
+			const int cy = (int) std::lround( cStar.fY );
+
+			// The corners of the square around the disk give us the
+			// background level, which we subtract before weighting
+			float fSquareSum = 0, fDiskSum = 0;
+			int nSquare = 0, nDisk = 0;
+			for ( int dy = -nRadius; dy <= nRadius; dy++ )
+			{
+				const int y = cy + dy;
+				if ( y < 0 || y >= img.rows )
+					continue;
+				const float * pRow = img.ptr<float>( y );
+				const int hw = vHalfWidths[dy + nRadius];
+				const int x0 = std::max( cx - nRadius, 0 ), x1 = std::min( cx + nRadius, img.cols - 1 );
+				const int xd0 = std::max( cx - hw, 0 ), xd1 = std::min( cx + hw, img.cols - 1 );
+				for ( int x = x0; x <= x1; x++ )
+					fSquareSum += pRow[x];
+				for ( int x = xd0; x <= xd1; x++ )
+					fDiskSum += pRow[x];
+				nSquare += std::max( x1 - x0 + 1, 0 );
+				nDisk += std::max( xd1 - xd0 + 1, 0 );
 			}
+			const float fBackground = nSquare > nDisk ? ( fSquareSum - fDiskSum ) / ( nSquare - nDisk ) : 0.f;
+
+			// Intensity weighted centroid over the disk
+			float fW = 0, fWX = 0, fWY = 0;
+			for ( int dy = -nRadius; dy <= nRadius; dy++ )
+			{
+				const int y = cy + dy;
+				if ( y < 0 || y >= img.rows )
+					continue;
+				const float * pRow = img.ptr<float>( y );
+				const int hw = vHalfWidths[dy + nRadius];
+				const int xd0 = std::max( cx - hw, 0 ), xd1 = std::min( cx + hw, img.cols - 1 );
+				float fRowW = 0, fRowWX = 0;
+#pragma omp simd reduction( +: fRowW, fRowWX )
+				for ( int x = xd0; x <= xd1; x++ )
+				{
+					const float w = std::max( pRow[x] - fBackground, 0.f );
+					fRowW += w;
+					fRowWX += w * ( x - cx );
+				}
+				fW += fRowW;
+				fWX += fRowWX;
+				fWY += fRowW * dy;
+			}
+
+			// Nothing above background, leave it where it is
+			if ( fW <= 0 )
+				break;
+
+			cStar.fX = cx + fWX / fW;
+			cStar.fY = cy + fWY / fW;
+
+			// Done once we're centered on the same pixel
+			if ( std::lround( cStar.fX ) == cx && std::lround( cStar.fY ) == cy )
+				break;
 		}
+	}
+}
+
+// Host version of FindStarsInImage
+#if !SH_CUDA
+
+// Rows labelled per task, small enough to spread across threads
+const int kLabelBandRows = 64;
+
+// A horizontal run of nonzero pixels, which is what we label
+struct PixelRun
+{
+	int nRow;
+	int nX0, nX1;	// inclusive
+	int nParent;	// union-find parent, an index into the run vector
+};
+
+static int findRoot( std::vector<PixelRun>& vRuns, int i )
+{
+	while ( vRuns[i].nParent != i )
+	{
+		// Path halving
+		vRuns[i].nParent = vRuns[vRuns[i].nParent].nParent;
+		i = vRuns[i].nParent;
+	}
+	return i;
+}
 
-		// If no match found, store this one
-		if ( !bMatchFound )
+static void joinRuns( std::vector<PixelRun>& vRuns, int a, int b )
+{
+	a = findRoot( vRuns, a );
+	b = findRoot( vRuns, b );
+
+	// The first run is always the root, so blobs stay in raster order
+	if ( a < b )
+		vRuns[b].nParent = a;
+	else if ( b < a )
+		vRuns[a].nParent = b;
+}
+
+// Join the runs of one row with the runs they touch in the row below
+// Both are sorted by x, so we can walk them together
+static void joinRows( std::vector<PixelRun>& vRuns, int i, const int nEndAbove, int j, const int nEndBelow )
+{
+	while ( i < nEndAbove && j < nEndBelow )
+	{
+		const int nX1Above = vRuns[i].nX1;
+		const int nX1Below = vRuns[j].nX1;
+		if ( nX1Above + 1 < vRuns[j].nX0 )
+			i++;
+		else if ( nX1Below + 1 < vRuns[i].nX0 )
+			j++;
+		else
 		{
-			vRet.push_back( cInput );
+			// They touch (diagonals count); whichever
+			// ends first can't touch anything after
+			joinRuns( vRuns, i, j );
+			if ( nX1Above < nX1Below )
+				i++;
+			else
+				j++;
 		}
 	}
+}
 
-	// Run it again if we are still collapsing
-	// This recursion will break when there are
-	// no more circles to collapse
-	if ( vInput.size() != vRet.size() )
-		vRet = CollapseCircles( vRet );
-
-	return vRet;
+// Append the runs in a row of bytes
+static void findRuns( const uint8_t * pRow, const int nCols, const int nRow, std::vector<PixelRun>& vRuns )
+{
+	int x = 0;
+	while ( x < nCols )
+	{
+		// Stars are sparse, so skip empty pixels 8 at a time
+		for ( uint64_t uBytes = 0; x + 8 <= nCols; x += 8 )
+		{
+			memcpy( &uBytes, pRow + x, sizeof( uBytes ) );
+			if ( uBytes )
+				break;
+		}
+		while ( x < nCols && pRow[x] == 0 )
+			x++;
+		if ( x == nCols )
+			break;
+
+		const int x0 = x;
+		while ( x < nCols && pRow[x] )
+			x++;
+		vRuns.push_back( { nRow, x0, x - 1, (int) vRuns.size() } );
+	}
 }
 
-// Host version of FindStarsInImage
-#if !SH_CUDA
+// Labels connected blobs of nonzero pixels and returns one circle per blob,
+// centered on its centroid. The radius is that of a disk with the same
+// second moments, but never less than fStarRadius since that's what we
+// use to match stars between frames
 std::vector<Circle> FindStarsInImage( float fStarRadius, img_t& dBoolImg )
 {
-	// We need a contiguous image of bytes (which we'll be treating as bools)
-	if ( dBoolImg.type() != CV_8U || dBoolImg.empty() || dBoolImg.isContinuous() == false )
+	// We need an image of bytes (which we'll be treating as bools)
+	if ( dBoolImg.type() != CV_8U || dBoolImg.empty() )
 		throw std::runtime_error( "Error: Stars must be found in boolean images!" );
 
-	// Find non-zero pixels in image, create circles
-	std::vector<Circle> vRet;
-	int x( 0 ), y( 0 );
-#pragma omp parallel for shared(vRet, dBoolImg) private (x, y)
-	for ( y = 0; y < dBoolImg.rows; y++ )
+	// Label runs within bands of rows in parallel; each band's runs
+	// are indexed locally, and vRowBegin marks where each row starts
+	const int nBands = ( dBoolImg.rows + kLabelBandRows - 1 ) / kLabelBandRows;
+	std::vector<std::vector<PixelRun>> vBandRuns( nBands );
+	std::vector<int> vRowBegin( dBoolImg.rows + 1 );
+#pragma omp parallel for schedule( dynamic )
+	for ( int b = 0; b < nBands; b++ )
 	{
-		for ( x = 0; x < dBoolImg.cols; x++ )
+		std::vector<PixelRun>& vRuns = vBandRuns[b];
+		const int y0 = b * kLabelBandRows;
+		const int y1 = std::min( y0 + kLabelBandRows, dBoolImg.rows );
+		for ( int y = y0; y < y1; y++ )
 		{
-			uint8_t val = dBoolImg.at<uint8_t>( y, x );
-			if ( val )
-			{
-#pragma omp critical
-				vRet.push_back( { (float) x, (float) y, fStarRadius } );
-			}
+			vRowBegin[y] = (int) vRuns.size();
+			findRuns( dBoolImg.ptr<uint8_t>( y ), dBoolImg.cols, y, vRuns );
+			if ( y > y0 )
+				joinRows( vRuns, vRowBegin[y - 1], vRowBegin[y], vRowBegin[y], (int) vRuns.size() );
+		}
+	}
+
+	// Gather the bands into one vector, offsetting their indices
+	std::vector<int> vBandBegin( nBands + 1, 0 );
+	for ( int b = 0; b < nBands; b++ )
+		vBandBegin[b + 1] = vBandBegin[b] + (int) vBandRuns[b].size();
+
+	std::vector<PixelRun> vRuns;
+	vRuns.reserve( vBandBegin[nBands] );
+	for ( int b = 0; b < nBands; b++ )
+	{
+		for ( PixelRun run : vBandRuns[b] )
+		{
+			run.nParent += vBandBegin[b];
+			vRuns.push_back( run );
+		}
+	}
+	for ( int y = 0; y < dBoolImg.rows; y++ )
+		vRowBegin[y] += vBandBegin[y / kLabelBandRows];
+	vRowBegin[dBoolImg.rows] = vBandBegin[nBands];
+
+	// Join blobs that cross band boundaries
+	for ( int b = 1; b < nBands; b++ )
+	{
+		const int y = b * kLabelBandRows;
+		joinRows( vRuns, vRowBegin[y - 1], vRowBegin[y], vRowBegin[y], vRowBegin[y + 1] );
+	}
+
+	// Accumulate pixel moments for each blob
+	struct Moments
+	{
+		double dN, dX, dY, dXX, dYY;
+	};
+	std::vector<Moments> vBlobs;
+	std::vector<int> vBlobIdx( vRuns.size() );
+	for ( int i = 0; i < (int) vRuns.size(); i++ )
+	{
+		// Roots come before the rest of their blob
+		const int nRoot = findRoot( vRuns, i );
+		if ( nRoot == i )
+		{
+			vBlobIdx[i] = (int) vBlobs.size();
+			vBlobs.push_back( { 0 } );
 		}
+		else
+			vBlobIdx[i] = vBlobIdx[nRoot];
+
+		// Sums of x and x^2 over the run are closed form
+		const PixelRun& run = vRuns[i];
+		const double dN = run.nX1 - run.nX0 + 1;
+		const double dY = run.nRow;
+		auto sumSq = [] ( double k ) { return k * ( k + 1 ) * ( 2 * k + 1 ) / 6; };
+		Moments& m = vBlobs[vBlobIdx[i]];
+		m.dN += dN;
+		m.dX += dN * ( run.nX0 + run.nX1 ) / 2;
+		m.dY += dN * dY;
+		m.dXX += sumSq( run.nX1 ) - sumSq( run.nX0 - 1 );
+		m.dYY += dN * dY * dY;
+	}
+
+	// Make circles - a solid disk of radius R has x and y
+	// variance R^2 / 4, and each pixel adds 1 / 12 of its own
+	std::vector<Circle> vRet;
+	vRet.reserve( vBlobs.size() );
+	for ( const Moments& m : vBlobs )
+	{
+		const double dCx = m.dX / m.dN;
+		const double dCy = m.dY / m.dN;
+		const double dVar = ( m.dXX / m.dN - dCx * dCx ) + ( m.dYY / m.dN - dCy * dCy ) + 1. / 6;
+		const float fR = (float) sqrt( 2 * std::max( 0., dVar ) );
+		vRet.push_back( { (float) dCx, (float) dCy, std::max( fStarRadius, fR ) } );
 	}
 
-	// Collapse star images and return
-	return CollapseCircles( vRet );
+	return vRet;
 }
 #endif
@@ -0,0 +1,259 @@
+#include "StarRegistration.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <complex>
+#include <map>
+#include <tuple>
+
+// Triangle descriptors are binned this finely, and
+// matching triangles can differ by up to a bin
+const float kDescriptorBin = 0.01f;
+const int kBinsPerRatio = 101;
+
+// Small or skinny triangles have unreliable ratios
+const float kMinSide = 4.f;
+const float kMinRatio = 0.1f;
+
+// Transform votes are binned by log scale, rotation and translation
+// (rotation bins go all the way round, so -pi and pi are neighbours)
+const double kScaleBin = 0.02;
+const int kRotationBins = 180;	// 2 degrees each
+const double kRotationBin = 2 * 3.14159265358979323846 / kRotationBins;
+const double kTransBin = 4;
+
+// The optics don't change between frames, so anything
+// that scales the field more than this is a bad match
+const double kMaxScaleChange = 1.25;
+
+// How close a transformed star has to land to count,
+// and how many have to before we believe the transform
+const float kInlierDist = 3.f;
+const int kMinInliers = 4;
+
+using Complex = std::complex<double>;
+using IndexPairs = std::vector<std::pair<int, int>>;
+
+Circle StarTransform::Apply( const Circle c ) const
+{
+	const float fCos = fScale * cos( fRotation );
+	const float fSin = fScale * sin( fRotation );
+	return { fCos * c.fX - fSin * c.fY + fTransX, fSin * c.fX + fCos * c.fY + fTransY, c.fR };
+}
+
+// Least squares similarity taking vFrom to vTo for the given index pairs. In
+// complex numbers that's z' = a * z + t, which has a closed form solution
+static bool fitSimilarity( const std::vector<Circle>& vFrom, const std::vector<Circle>& vTo, const IndexPairs& vPairs, StarTransform * pTransform )
+{
+	if ( vPairs.empty() )
+		return false;
+
+	Complex zFromMean, zToMean;
+	for ( const std::pair<int, int>& pair : vPairs )
+	{
+		zFromMean += Complex( vFrom[pair.first].fX, vFrom[pair.first].fY );
+		zToMean += Complex( vTo[pair.second].fX, vTo[pair.second].fY );
+	}
+	zFromMean /= double( vPairs.size() );
+	zToMean /= double( vPairs.size() );
+
+	Complex zNum;
+	double dDen = 0;
+	for ( const std::pair<int, int>& pair : vPairs )
+	{
+		const Complex zFrom = Complex( vFrom[pair.first].fX, vFrom[pair.first].fY ) - zFromMean;
+		const Complex zTo = Complex( vTo[pair.second].fX, vTo[pair.second].fY ) - zToMean;
+		zNum += zTo * std::conj( zFrom );
+		dDen += std::norm( zFrom );
+	}
+	if ( dDen < 1e-9 )
+		return false;
+
+	const Complex a = zNum / dDen;
+	const Complex t = zToMean - a * zFromMean;
+	pTransform->fScale = (float) std::abs( a );
+	pTransform->fRotation = (float) std::arg( a );
+	pTransform->fTransX = (float) t.real();
+	pTransform->fTransY = (float) t.imag();
+	return true;
+}
+
+static int descriptorBin( const int nMidBin, const int nMinBin )
+{
+	return nMidBin * kBinsPerRatio + nMinBin;
+}
+
+// Rotations are angles, so their bins wrap around
+static int rotationBin( const double dRotation )
+{
+	const int nBin = (int) floor( dRotation / kRotationBin ) % kRotationBins;
+	return nBin < 0 ? nBin + kRotationBins : nBin;
+}
+
+static int rotationBinDistance( const int nBinA, const int nBinB )
+{
+	const int nDist = abs( nBinA - nBinB );
+	return std::min( nDist, kRotationBins - nDist );
+}
+
+// Makes triangles from every triple of the first nMaxStars stars
+static std::vector<StarRegistration::Triangle> buildTriangles( const std::vector<Circle>& vStars, const int nMaxStars )
+{
+	std::vector<StarRegistration::Triangle> vTriangles;
+	const int nStars = std::min( (int) vStars.size(), nMaxStars );
+	for ( int i = 0; i < nStars; i++ )
+	{
+		for ( int j = i + 1; j < nStars; j++ )
+		{
+			for ( int k = j + 1; k < nStars; k++ )
+			{
+				// Pair each vertex with the length of the side opposite it, shortest first
+				auto dist = [&vStars] ( int a, int b ) { return hypotf( vStars[a].fX - vStars[b].fX, vStars[a].fY - vStars[b].fY ); };
+				std::pair<float, int> aSides[3] = { { dist( j, k ), i }, { dist( i, k ), j }, { dist( i, j ), k } };
+				std::sort( aSides, aSides + 3 );
+				if ( aSides[0].first < kMinSide || aSides[0].first < kMinRatio * aSides[2].first )
+					continue;
+
+				StarRegistration::Triangle tri;
+				for ( int v = 0; v < 3; v++ )
+					tri.aVertices[v] = aSides[v].second;
+				tri.fMidRatio = aSides[1].first / aSides[2].first;
+				tri.fMinRatio = aSides[0].first / aSides[2].first;
+
+				// Similarities don't mirror, so the winding has to match too
+				const Circle c0 = vStars[tri.aVertices[0]];
+				const Circle c1 = vStars[tri.aVertices[1]];
+				const Circle c2 = vStars[tri.aVertices[2]];
+				tri.bCounterClockwise = ( c1.fX - c0.fX ) * ( c2.fY - c0.fY ) - ( c1.fY - c0.fY ) * ( c2.fX - c0.fX ) > 0;
+
+				vTriangles.push_back( tri );
+			}
+		}
+	}
+
+	return vTriangles;
+}
+
+StarRegistration::StarRegistration( const std::vector<Circle>& vRefStars, const int nMaxStars ) :
+	m_nMaxStars( nMaxStars ),
+	m_vRefStars( vRefStars ),
+	m_vRefTriangles( buildTriangles( vRefStars, nMaxStars ) )
+{
+	m_vRefIndex.reserve( m_vRefTriangles.size() );
+	for ( int i = 0; i < (int) m_vRefTriangles.size(); i++ )
+	{
+		const Triangle& tri = m_vRefTriangles[i];
+		m_vRefIndex.emplace_back( descriptorBin( int( tri.fMidRatio / kDescriptorBin ), int( tri.fMinRatio / kDescriptorBin ) ), i );
+	}
+	std::sort( m_vRefIndex.begin(), m_vRefIndex.end() );
+}
+
+bool StarRegistration::Register( const std::vector<Circle>& vStars, StarTransform * pTransform ) const
+{
+	if ( pTransform == nullptr )
+		return false;
+
+	// Every pair of similar triangles votes for the transform between them
+	using VoteBin = std::tuple<int, int, int, int>;
+	struct Vote
+	{
+		VoteBin bin;
+		int nRefTriangle;
+		int nTriangle;
+	};
+	std::vector<Vote> vVotes;
+	std::map<VoteBin, int> mapVoteCounts;
+
+	const std::vector<Triangle> vTriangles = buildTriangles( vStars, m_nMaxStars );
+	for ( int t = 0; t < (int) vTriangles.size(); t++ )
+	{
+		const Triangle& tri = vTriangles[t];
+		const int nMidBin = int( tri.fMidRatio / kDescriptorBin );
+		const int nMinBin = int( tri.fMinRatio / kDescriptorBin );
+		for ( int nMid = nMidBin - 1; nMid <= nMidBin + 1; nMid++ )
+		{
+			for ( int nMin = nMinBin - 1; nMin <= nMinBin + 1; nMin++ )
+			{
+				auto it = std::lower_bound( m_vRefIndex.begin(), m_vRefIndex.end(), std::make_pair( descriptorBin( nMid, nMin ), INT_MIN ) );
+				for ( ; it != m_vRefIndex.end() && it->first == descriptorBin( nMid, nMin ); ++it )
+				{
+					const Triangle& refTri = m_vRefTriangles[it->second];
+					if ( refTri.bCounterClockwise != tri.bCounterClockwise ||
+						 fabs( refTri.fMidRatio - tri.fMidRatio ) > kDescriptorBin ||
+						 fabs( refTri.fMinRatio - tri.fMinRatio ) > kDescriptorBin )
+						continue;
+
+					IndexPairs vPairs;
+					for ( int v = 0; v < 3; v++ )
+						vPairs.emplace_back( refTri.aVertices[v], tri.aVertices[v] );
+
+					StarTransform xf;
+					if ( !fitSimilarity( m_vRefStars, vStars, vPairs, &xf ) || fabs( log( xf.fScale ) ) > log( kMaxScaleChange ) )
+						continue;
+
+					Vote vote;
+					vote.bin = VoteBin( (int) floor( log( xf.fScale ) / kScaleBin ), rotationBin( xf.fRotation ),
+										(int) floor( xf.fTransX / kTransBin ), (int) floor( xf.fTransY / kTransBin ) );
+					vote.nRefTriangle = it->second;
+					vote.nTriangle = t;
+					vVotes.push_back( vote );
+					mapVoteCounts[vote.bin]++;
+				}
+			}
+		}
+	}
+
+	if ( mapVoteCounts.empty() )
+		return false;
+
+	// Find the most popular transform
+	auto itBest = std::max_element( mapVoteCounts.begin(), mapVoteCounts.end(),
+									[] ( const std::pair<const VoteBin, int>& a, const std::pair<const VoteBin, int>& b ) { return a.second < b.second; } );
+	const VoteBin best = itBest->first;
+
+	// The triangles that voted for it (or a neighbouring bin, since
+	// noise can push a vote over an edge) say which stars are which
+	std::map<std::pair<int, int>, int> mapPairVotes;
+	for ( const Vote& vote : vVotes )
+	{
+		if ( abs( std::get<0>( vote.bin ) - std::get<0>( best ) ) > 1 || rotationBinDistance( std::get<1>( vote.bin ), std::get<1>( best ) ) > 1 ||
+			 abs( std::get<2>( vote.bin ) - std::get<2>( best ) ) > 1 || abs( std::get<3>( vote.bin ) - std::get<3>( best ) ) > 1 )
+			continue;
+
+		for ( int v = 0; v < 3; v++ )
+			mapPairVotes[{ m_vRefTriangles[vote.nRefTriangle].aVertices[v], vTriangles[vote.nTriangle].aVertices[v] }]++;
+	}
+
+	// Give each reference star the star it was paired with most
+	std::map<int, std::pair<int, int>> mapBestPair;
+	for ( const auto& pairVotes : mapPairVotes )
+	{
+		std::pair<int, int>& bestPair = mapBestPair.emplace( pairVotes.first.first, std::make_pair( -1, 0 ) ).first->second;
+		if ( pairVotes.second > bestPair.second )
+			bestPair = { pairVotes.first.second, pairVotes.second };
+	}
+
+	IndexPairs vPairs;
+	for ( const auto& bestPair : mapBestPair )
+		vPairs.emplace_back( bestPair.first, bestPair.second.first );
+
+	// Fit all of them, then refit with the ones that agree
+	StarTransform xf;
+	if ( !fitSimilarity( m_vRefStars, vStars, vPairs, &xf ) )
+		return false;
+
+	IndexPairs vInliers;
+	for ( const std::pair<int, int>& pair : vPairs )
+	{
+		const Circle cMoved = xf.Apply( m_vRefStars[pair.first] );
+		if ( hypotf( cMoved.fX - vStars[pair.second].fX, cMoved.fY - vStars[pair.second].fY ) < kInlierDist )
+			vInliers.push_back( pair );
+	}
+
+	if ( (int) vInliers.size() < kMinInliers || !fitSimilarity( m_vRefStars, vStars, vInliers, &xf ) )
+		return false;
+
+	*pTransform = xf;
+	return true;
+}
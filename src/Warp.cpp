@@ -0,0 +1,152 @@
+#include "Warp.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <stdexcept>
+
+#if defined( __GNUC__ ) && ( defined( __x86_64__ ) || defined( __i386__ ) )
+#define SH_WARP_AVX2 1
+#endif
+
+#if defined( __GNUC__ )
+#define SH_WARP_INLINE inline __attribute__( ( always_inline ) )
+#else
+#define SH_WARP_INLINE inline
+#endif
+
+// Warps row y of the destination. Everything's written as selects and
+// clamped indices rather than branches so the loop vectorizes (the four
+// taps are gathers). A tap's index only moves past the first one if its
+// weight isn't zero, so exact samples never read the border
+static SH_WARP_INLINE void warpRow( const float * pSrc, const int nSrcStride, const int nSrcCols, const int nSrcRows,
+							const float * afMap, const int y, const int nDstCols, const float fBorder, float * pDst )
+{
+	const float fStepX = afMap[0];
+	const float fStepY = afMap[3];
+	const float fRowX = afMap[1] * y + afMap[2];
+	const float fRowY = afMap[4] * y + afMap[5];
+
+	// Anything further out than this is all border anyway,
+	// and keeping it in range keeps the int conversions sane
+	const float fMaxX = float( nSrcCols + 1 );
+	const float fMaxY = float( nSrcRows + 1 );
+
+#pragma omp simd
+	for ( int x = 0; x < nDstCols; x++ )
+	{
+		const float fX = std::min( std::max( fStepX * x + fRowX, -2.f ), fMaxX );
+		const float fY = std::min( std::max( fStepY * x + fRowY, -2.f ), fMaxY );
+		// They're >= -2, so truncating from 2 up is floor (and a
+		// conversion the vectorizer knows, unlike std::floor)
+		const int nX0 = int( fX + 2.f ) - 2;
+		const int nY0 = int( fY + 2.f ) - 2;
+		const float fU = fX - nX0;
+		const float fV = fY - nY0;
+		const int nX1 = nX0 + ( fU > 0.f );
+		const int nY1 = nY0 + ( fV > 0.f );
+
+		const int bX0 = ( nX0 >= 0 ) & ( nX0 < nSrcCols );
+		const int bX1 = ( nX1 >= 0 ) & ( nX1 < nSrcCols );
+		const int bY0 = ( nY0 >= 0 ) & ( nY0 < nSrcRows );
+		const int bY1 = ( nY1 >= 0 ) & ( nY1 < nSrcRows );
+
+		const int nCX0 = std::min( std::max( nX0, 0 ), nSrcCols - 1 );
+		const int nCX1 = std::min( std::max( nX1, 0 ), nSrcCols - 1 );
+		const int nCY0 = std::min( std::max( nY0, 0 ), nSrcRows - 1 ) * nSrcStride;
+		const int nCY1 = std::min( std::max( nY1, 0 ), nSrcRows - 1 ) * nSrcStride;
+
+		// The clamped taps are always safe to read, then off image ones are swapped out
+		const float s00 = pSrc[nCY0 + nCX0];
+		const float s01 = pSrc[nCY0 + nCX1];
+		const float s10 = pSrc[nCY1 + nCX0];
+		const float s11 = pSrc[nCY1 + nCX1];
+		const float f00 = bX0 & bY0 ? s00 : fBorder;
+		const float f01 = bX1 & bY0 ? s01 : fBorder;
+		const float f10 = bX0 & bY1 ? s10 : fBorder;
+		const float f11 = bX1 & bY1 ? s11 : fBorder;
+
+		// An unused tap has zero weight and is the same pixel as its
+		// neighbour, so the differences are 0 and samples on the last
+		// row or column come out exact (rather than 0 * NaN)
+		const float fTop = f00 + fU * ( f01 - f00 );
+		const float fBottom = f10 + fU * ( f11 - f10 );
+		pDst[x] = fTop + fV * ( fBottom - fTop );
+	}
+}
+
+static void warpRow_Default( const float * pSrc, const int nSrcStride, const int nSrcCols, const int nSrcRows,
+							 const float * afMap, const int y, const int nDstCols, const float fBorder, float * pDst )
+{
+	warpRow( pSrc, nSrcStride, nSrcCols, nSrcRows, afMap, y, nDstCols, fBorder, pDst );
+}
+
+#if SH_WARP_AVX2
+// Same code, but the compiler gets to use AVX2 gathers
+__attribute__( ( target( "avx2,fma" ) ) )
+static void warpRow_AVX2( const float * pSrc, const int nSrcStride, const int nSrcCols, const int nSrcRows,
+						  const float * afMap, const int y, const int nDstCols, const float fBorder, float * pDst )
+{
+	warpRow( pSrc, nSrcStride, nSrcCols, nSrcRows, afMap, y, nDstCols, fBorder, pDst );
+}
+#endif
+
+using WarpRowFn = void ( * )( const float *, const int, const int, const int, const float *, const int, const int, const float, float * );
+
+// Pick the best kernel for this CPU once
+static WarpRowFn getWarpRowKernel()
+{
+#if SH_WARP_AVX2
+	if ( __builtin_cpu_supports( "avx2" ) && __builtin_cpu_supports( "fma" ) )
+		return warpRow_AVX2;
+#endif
+	return warpRow_Default;
+}
+
+void WarpAffineBilinear( const cv::Mat& imgSrc, const double adInvMap[6], const float fBorder, const cv::Size szDst, cv::Mat& imgDst )
+{
+	if ( imgSrc.type() != CV_32FC1 )
+		throw std::runtime_error( "Error: WarpAffineBilinear only warps single channel float images!" );
+	if ( imgSrc.empty() )
+		throw std::runtime_error( "Error: WarpAffineBilinear was given an empty image!" );
+	if ( imgSrc.data == imgDst.data )
+		throw std::runtime_error( "Error: WarpAffineBilinear can't warp an image in place!" );
+
+	static const WarpRowFn fnKernel = getWarpRowKernel();
+
+	imgDst.create( szDst, CV_32FC1 );
+
+	// Float is plenty for a frame's worth of coordinates
+	float afMap[6];
+	for ( int i = 0; i < 6; i++ )
+		afMap[i] = (float) adInvMap[i];
+
+	// Tap offsets are ints, so gathers can use 32 bit indices
+	if ( imgSrc.step1() * imgSrc.rows > INT_MAX )
+		throw std::runtime_error( "Error: WarpAffineBilinear was given too big an image!" );
+	const float * pSrc = imgSrc.ptr<float>();
+	const int nSrcStride = (int) imgSrc.step1();
+
+#pragma omp parallel for
+	for ( int y = 0; y < szDst.height; y++ )
+		fnKernel( pSrc, nSrcStride, imgSrc.cols, imgSrc.rows, afMap, y, szDst.width, fBorder, imgDst.ptr<float>( y ) );
+}
+
+void GetShiftRotateMap( const cv::Size szImage, const float fShiftX, const float fShiftY, const float fRotation, double adInvMap[6] )
+{
+	// Forward it's p' = R( p - c ) + c + t, so going
+	// back it's p = R^-1 ( p' - c - t ) + c
+	const double dCos = cos( fRotation );
+	const double dSin = sin( fRotation );
+	const double dCenterX = .5 * ( szImage.width - 1 );
+	const double dCenterY = .5 * ( szImage.height - 1 );
+	const double dX = dCenterX + fShiftX;
+	const double dY = dCenterY + fShiftY;
+
+	adInvMap[0] = dCos;
+	adInvMap[1] = dSin;
+	adInvMap[2] = dCenterX - dCos * dX - dSin * dY;
+	adInvMap[3] = -dSin;
+	adInvMap[4] = dCos;
+	adInvMap[5] = dCenterY + dSin * dX - dCos * dY;
+}
@@ -1,6 +1,7 @@
 #include "Engine.h"
 #include "StarFinder.h"
 #include "FileReader.h"
+#include "StarField.h"
 #include "Camera.h"
 #include "TelescopeComm.h"
 
@@ -18,16 +19,30 @@ int main(int argc, char ** argv)
 
 	return -1;
 #else
-	std::list<std::string> liInput;
-	for ( int i = 0; i < 5; i++ )
+	// Read the files we're given, or make up some stars to look at
+	std::unique_ptr<ImageSource> pImgSrc;
+	if ( argc > 1 )
 	{
-		liInput.push_back( "fakeStarImage_" + std::to_string( i + 1 ) + ".png" );
-	}
+		std::list<std::string> liInput( argv + 1, argv + argc );
 
-	std::unique_ptr<ImageSource> pImgSrc = ImageSource::Ptr( new FileReader_WithDrift( liInput ) );
+		// Decode a few files ahead on a couple of threads
+		FileReader_WithDrift * pFileReader = new FileReader_WithDrift( liInput );
+		pFileReader->SetPrefetch( 4, 2 );
+		pImgSrc.reset( pFileReader );
+	}
+	else
+	{
+		StarFieldParams params;
+		params.nFrames = 5;
+		params.fDriftX = 1.5f;
+		params.fDriftY = -.5f;
+		pImgSrc.reset( new StarFieldSource( params ) );
+	}
 	std::unique_ptr<ImageProcessor> pImgProc = ImageProcessor::Ptr( new StarFinder_UI() );
 	
+	// Read the next file while the star finder works on this one
 	Engine E( std::move( pImgSrc ), std::move( pImgProc ) );
+	E.SetPipelined( 2 );
 	E.Run();
 
 	return 0;	